@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "engine.h"
+#include "trace.h"
+
+// Replay benchmark: feeds a recorded (or synthesized) trace through the engine as fast as possible,
+// on the clock of the trace, and reports the throughput. Optionally checks the output against a
+// golden trace so behaviour changes show up next to speed changes.
+
+#define MAX_TIMERS (MAX_AXES * 4)
+
+struct trace {
+    const struct trace_record *records;
+    size_t count;
+};
+
+// Benchmark context
+static struct {
+    uint64_t clock; // Virtual time, follows the trace
+    uint64_t tick_ns; // Tick mode like socd --tick-rate, 0 when off
+    int neutral_ticks;
+    uint64_t timers[MAX_TIMERS]; // Pending neutral deadlines
+    int timer_count;
+    char capture; // Keep the output of this pass
+    struct trace_record *out;
+    size_t out_count, out_cap;
+    uint64_t out_events, out_frames;
+} bench;
+
+static void bench_write(const struct input_event *events, size_t count) {
+    bench.out_events += count;
+    bench.out_frames++;
+    if (!bench.capture) return;
+
+    if (bench.out_count + count > bench.out_cap) {
+        bench.out_cap = (bench.out_cap + count) * 2;
+        bench.out = realloc(bench.out, bench.out_cap * sizeof(*bench.out));
+        if (!bench.out) exit(1);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        bench.out[bench.out_count++] = (struct trace_record){
+            .time = bench.clock, .type = events[i].type, .code = events[i].code, .value = events[i].value, .tag = TRACE_OUTPUT
+        };
+    }
+}
+
+static void bench_timer(uint64_t deadline) {
+    if (bench.tick_ns) return; // Neutral windows end on a tick
+    if (bench.timer_count < MAX_TIMERS) bench.timers[bench.timer_count++] = deadline;
+}
+
+static uint64_t bench_now(void) {
+    return bench.clock;
+}
+
+static const struct sink bench_sink = { .write = bench_write, .arm_timer = bench_timer, .now = bench_now };
+
+// Fire every timer due by until, in deadline order, like the timeout completions of the daemon
+static void run_timers(uint64_t until) {
+    while (bench.timer_count) {
+        int next = 0;
+        for (int i = 1; i < bench.timer_count; ++i) {
+            if (bench.timers[i] < bench.timers[next]) next = i;
+        }
+        if (bench.timers[next] > until) return;
+        if (bench.timers[next] > bench.clock) bench.clock = bench.timers[next];
+        bench.timers[next] = bench.timers[--bench.timer_count];
+        emit_all();
+    }
+}
+
+// Flush the coalesced state on every tick due by until
+static void run_ticks(uint64_t until) {
+    while ((engine.frame_counter + 1) * bench.tick_ns <= until) {
+        engine.frame_counter++;
+        bench.clock = engine.frame_counter * bench.tick_ns;
+        emit_all();
+    }
+}
+
+// One pass over the input events of a trace, frames end at each SYN_REPORT like a read completion
+static void replay(const struct trace *trace) {
+    reset_state();
+    bench.clock = 0;
+    bench.timer_count = 0;
+    engine.frame_counter = 0;
+
+    for (size_t i = 0; i < trace->count; ++i) {
+        const struct trace_record *rec = &trace->records[i];
+        if (rec->tag & TRACE_OUTPUT) continue;
+
+        if (bench.tick_ns) run_ticks(rec->time);
+        else run_timers(rec->time);
+        if (rec->time > bench.clock) bench.clock = rec->time;
+        struct input_event ev = {
+            .input_event_sec = rec->time / 1000000000, .input_event_usec = rec->time % 1000000000 / 1000,
+            .type = rec->type, .code = rec->code, .value = rec->value
+        };
+        process_event(TRACE_DEV(rec->tag) % MAX_DEVICES, &ev);
+        if (rec->type == EV_SYN && rec->code == SYN_REPORT && !bench.tick_ns) emit_all();
+    }
+    if (bench.tick_ns) {
+        // Ticks until the last neutral window is over
+        run_ticks(bench.clock + (bench.neutral_ticks + 1) * bench.tick_ns);
+        return;
+    }
+    emit_all();
+    run_timers(UINT64_MAX);
+}
+
+static struct trace map_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    const struct trace_header *header = NULL;
+    if ((size_t)st.st_size >= sizeof(*header)) header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (!header || header == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != TRACE_VERSION || header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a version %d socd trace\n", path, TRACE_VERSION);
+        exit(1);
+    }
+    return (struct trace){
+        .records = (const struct trace_record *)(header + 1),
+        .count = (st.st_size - sizeof(*header)) / sizeof(struct trace_record)
+    };
+}
+
+static void write_trace(const char *path, const struct trace_record *records, size_t count) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    struct trace_header header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .record_size = sizeof(*records) };
+    if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(records, sizeof(*records), count, f) != count || fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+// Random presses and releases of the configured keys, 0.5-20 ms apart, spread over two devices
+static struct trace synth_trace(size_t events, uint32_t seed) {
+    struct trace_record *records = calloc(events * 2, sizeof(*records));
+    char held[MAX_SLOTS][2] = { { 0 } };
+    uint64_t time = 1000000000;
+    if (!records) exit(1);
+
+    for (size_t i = 0; i < events; ++i) {
+        seed = seed * 1664525 + 1013904223;
+        int slot = (seed >> 8) % (engine.config->axis_count * 2), dev = (seed >> 20) & 1;
+        time += 500000 + (seed >> 4) % 19500000;
+        held[slot][dev] ^= 1;
+        records[2 * i] = (struct trace_record){
+            .time = time, .type = EV_KEY, .code = engine.config->axes[slot / 2].keys[slot % 2], .value = held[slot][dev], .tag = dev
+        };
+        records[2 * i + 1] = (struct trace_record){ .time = time, .type = EV_SYN, .code = SYN_REPORT, .tag = dev };
+    }
+    return (struct trace){ .records = records, .count = events * 2 };
+}
+
+// Compare the captured output with the output records of a golden trace
+static int check_golden(const struct trace *golden) {
+    size_t j = 0;
+    for (size_t i = 0; i < golden->count; ++i) {
+        const struct trace_record *want = &golden->records[i];
+        if (!(want->tag & TRACE_OUTPUT)) continue;
+        if (j == bench.out_count) {
+            fprintf(stderr, "golden: output ends after %zu events, expected more\n", j);
+            return 1;
+        }
+        const struct trace_record *got = &bench.out[j];
+        if (got->time != want->time || got->type != want->type || got->code != want->code || got->value != want->value) {
+            fprintf(stderr, "golden: output event %zu is %u/%u/%d at %llu ns, expected %u/%u/%d at %llu ns\n", j,
+                    got->type, got->code, got->value, (unsigned long long)got->time,
+                    want->type, want->code, want->value, (unsigned long long)want->time);
+            return 1;
+        }
+        j++;
+    }
+    if (j != bench.out_count) {
+        fprintf(stderr, "golden: %zu output events, expected %zu\n", bench.out_count, j);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [options] [TRACE]\n"
+           "  -C, --config FILE      key pairs to clean (default WASD)\n"
+           "  -n, --neutral-ms MS    neutral window on a SOCD conflict in ms (default 16.7)\n"
+           "  -g, --grab             forward keys that are not cleaned, like socd --grab\n"
+           "  -t, --tick-rate HZ     write once per tick, like socd --tick-rate\n"
+           "  -T, --neutral-ticks N  neutral window in tick mode, in ticks (default 1)\n"
+           "  -s, --synth N          replay N random key events instead of TRACE\n"
+           "  -S, --seed SEED        seed for --synth (default 1)\n"
+           "  -o, --save-trace FILE  write the input trace (useful with --synth)\n"
+           "  -r, --repeat N         timed passes over the trace (default 10)\n"
+           "  -G, --golden FILE      fail unless the output matches the output events of FILE\n"
+           "  -w, --write-golden FILE  write input and output of the trace, for use with --golden\n"
+           "  -h, --help             show this help\n", name);
+}
+
+static const struct option long_options[] = {
+    { "config",       required_argument, NULL, 'C' },
+    { "neutral-ms",   required_argument, NULL, 'n' },
+    { "grab",         no_argument,       NULL, 'g' },
+    { "tick-rate",    required_argument, NULL, 't' },
+    { "neutral-ticks", required_argument, NULL, 'T' },
+    { "synth",        required_argument, NULL, 's' },
+    { "seed",         required_argument, NULL, 'S' },
+    { "save-trace",   required_argument, NULL, 'o' },
+    { "repeat",       required_argument, NULL, 'r' },
+    { "golden",       required_argument, NULL, 'G' },
+    { "write-golden", required_argument, NULL, 'w' },
+    { "help",         no_argument,       NULL, 'h' },
+    { 0 }
+};
+
+int main(int argc, char **argv) {
+    const char *golden_path = NULL, *write_golden = NULL, *save_trace = NULL;
+    size_t synth = 0;
+    uint32_t seed = 1;
+    int repeat = 10, opt;
+    bench.neutral_ticks = 1;
+
+    while ((opt = getopt_long(argc, argv, "C:n:gt:T:s:S:o:r:G:w:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'C':
+            load_config(optarg);
+            break;
+        case 'n': {
+            double ms = strtod(optarg, NULL);
+            engine.neutral_ns = ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+            break;
+        }
+        case 'g':
+            engine.passthrough = 1;
+            break;
+        case 't': {
+            double hz = strtod(optarg, NULL);
+            bench.tick_ns = hz > 0 ? (uint64_t)(1e9 / hz) : 0;
+            break;
+        }
+        case 'T':
+            bench.neutral_ticks = atoi(optarg);
+            break;
+        case 's':
+            synth = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            save_trace = optarg;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'G':
+            golden_path = optarg;
+            break;
+        case 'w':
+            write_golden = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (!synth && optind >= argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    engine.sink = &bench_sink;
+    if (bench.tick_ns) engine.neutral_ns = bench.neutral_ticks * bench.tick_ns;
+    setup_config(engine.config);
+    struct trace trace = synth ? synth_trace(synth, seed) : map_trace(argv[optind]);
+    if (save_trace) write_trace(save_trace, trace.records, trace.count);
+
+    size_t inputs = 0;
+    for (size_t i = 0; i < trace.count; ++i) inputs += !(trace.records[i].tag & TRACE_OUTPUT);
+
+    // Untimed pass that keeps the output for the determinism checks
+    bench.capture = 1;
+    replay(&trace);
+    bench.capture = 0;
+    uint64_t frames = bench.out_frames, events = bench.out_events;
+
+    int failed = 0;
+    if (golden_path) {
+        struct trace golden = map_trace(golden_path);
+        failed = check_golden(&golden);
+        printf("golden: %s\n", failed ? "MISMATCH" : "ok");
+    }
+    if (write_golden) {
+        struct trace_record *all = malloc((inputs + bench.out_count) * sizeof(*all));
+        if (!all) exit(1);
+        size_t n = 0;
+        for (size_t i = 0; i < trace.count; ++i) {
+            if (!(trace.records[i].tag & TRACE_OUTPUT)) all[n++] = trace.records[i];
+        }
+        memcpy(all + n, bench.out, bench.out_count * sizeof(*all));
+        write_trace(write_golden, all, n + bench.out_count);
+        free(all);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < repeat; ++r) replay(&trace);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    double total = (double)inputs * repeat;
+    printf("%zu input events, %llu output events in %llu frames per pass\n", inputs,
+           (unsigned long long)events, (unsigned long long)frames);
+    if (repeat > 0 && inputs > 0) {
+        printf("%d passes: %.0f events/s, %.1f ns/event\n", repeat, total / (ns / 1e9), ns / total);
+    }
+    free(bench.out);
+    return failed;
+}
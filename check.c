@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "engine.h"
+
+// Assertions on the behaviour of the engine, run by make check next to the golden replay: resolution
+// of every policy, the neutral window deadline and the hysteresis of analog sources. Events go in on a
+// virtual clock, the output is tracked as the keys pressed on the virtual device.
+
+#define NEUTRAL_NS 10000000 // Neutral window of the checks, 10 ms
+#define STEP_NS    1000000 // Time between two inputs
+
+// Check context
+static struct {
+    uint64_t clock; // Virtual time
+    uint64_t deadline; // Last timer armed by the engine, 0 when none
+    char pressed[KEY_MAX + 1]; // Output state
+    int failures;
+} ck;
+
+static void ck_write(const struct input_event *events, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (events[i].type == EV_KEY && events[i].value != 2) ck.pressed[events[i].code] = (char)events[i].value;
+    }
+}
+
+static void ck_timer(uint64_t deadline) {
+    ck.deadline = deadline;
+}
+
+static uint64_t ck_now(void) {
+    return ck.clock;
+}
+
+static const struct sink ck_sink = { .write = ck_write, .arm_timer = ck_timer, .now = ck_now };
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        ck.failures++; \
+    } \
+} while (0)
+
+// One axis KEY_A/KEY_D with a policy, nothing held
+static struct config *use_axis(int policy, int priority) {
+    struct config *config = engine.config;
+    memset(config, 0, sizeof(*config));
+    config->axes[0] = (struct axis){ .keys = { KEY_A, KEY_D }, .policy = policy, .priority = (uint8_t)priority };
+    config->axis_count = 1;
+    setup_config(config);
+    reset_state();
+    memset(ck.pressed, 0, sizeof(ck.pressed));
+    ck.deadline = 0;
+    return config;
+}
+
+// An event of device 0 a step after the last one, resolved and written like one read batch
+static void input(int type, int code, int value) {
+    ck.clock += STEP_NS;
+    struct input_event ev = {
+        .input_event_sec = ck.clock / 1000000000, .input_event_usec = ck.clock % 1000000000 / 1000,
+        .type = type, .code = code, .value = value
+    };
+    process_event(0, &ev);
+    emit_all();
+}
+
+static void key(int code, int value) {
+    input(EV_KEY, code, value);
+}
+
+static void check_last(void) {
+    use_axis(POLICY_LAST, 0);
+    key(KEY_A, 1);
+    CHECK(ck.pressed[KEY_A], "A is held alone");
+
+    key(KEY_D, 1);
+    uint64_t pressed_at = ck.clock;
+    CHECK(!ck.pressed[KEY_A] && !ck.pressed[KEY_D], "both released during the neutral window");
+    CHECK(ck.deadline == pressed_at + NEUTRAL_NS, "window ends %llu ns after the press, expected %d",
+          (unsigned long long)(ck.deadline - pressed_at), NEUTRAL_NS);
+
+    ck.clock = ck.deadline - 1;
+    emit_all();
+    CHECK(!ck.pressed[KEY_D], "D is not pressed before the deadline");
+    ck.clock = ck.deadline;
+    emit_all();
+    CHECK(ck.pressed[KEY_D] && !ck.pressed[KEY_A], "the last key wins at the deadline");
+
+    key(KEY_D, 0);
+    CHECK(ck.pressed[KEY_A] && !ck.pressed[KEY_D], "A comes back once D is released");
+}
+
+static void check_first(void) {
+    use_axis(POLICY_FIRST, 0);
+    key(KEY_A, 1);
+    key(KEY_D, 1);
+    CHECK(ck.pressed[KEY_A] && !ck.pressed[KEY_D], "the key held first keeps winning");
+    CHECK(!ck.deadline, "no neutral window");
+    key(KEY_A, 0);
+    CHECK(ck.pressed[KEY_D] && !ck.pressed[KEY_A], "D once A is released");
+}
+
+static void check_neutral(void) {
+    use_axis(POLICY_NEUTRAL, 0);
+    key(KEY_A, 1);
+    key(KEY_D, 1);
+    CHECK(!ck.pressed[KEY_A] && !ck.pressed[KEY_D], "neither key while both are held");
+    key(KEY_A, 0);
+    CHECK(ck.pressed[KEY_D], "D once A is released");
+}
+
+static void check_absolute(void) {
+    for (int first = 0; first < 2; ++first) {
+        use_axis(POLICY_ABSOLUTE, 1);
+        key(first ? KEY_D : KEY_A, 1);
+        key(first ? KEY_A : KEY_D, 1);
+        CHECK(ck.pressed[KEY_D] && !ck.pressed[KEY_A], "D always wins, pressed %s", first ? "first" : "last");
+        key(KEY_D, 0);
+        CHECK(ck.pressed[KEY_A], "A once D is released");
+    }
+}
+
+// Press past 50 percent of the deflection, release below 30
+static void check_abs(void) {
+    struct config *config = use_axis(POLICY_LAST, 0);
+    config->abs[0] = (struct abs_source){ .code = ABS_X, .keys = { KEY_A, KEY_D }, .press_pct = 50, .release_pct = 30 };
+    config->abs_count = 1;
+    setup_config(config);
+    set_abs_range(0, ABS_X, -100, 100);
+
+    static const struct { int value; char a, d; } steps[] = {
+        { 40, 0, 0 }, { 60, 0, 1 }, { 40, 0, 1 }, { 30, 0, 1 }, { 20, 0, 0 }, { 45, 0, 0 },
+        { -50, 1, 0 }, { -35, 1, 0 }, { -25, 0, 0 }, { 0, 0, 0 },
+    };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+        input(EV_ABS, ABS_X, steps[i].value);
+        CHECK(ck.pressed[KEY_A] == steps[i].a && ck.pressed[KEY_D] == steps[i].d, "at %d A is %d D is %d, expected %d %d",
+              steps[i].value, ck.pressed[KEY_A], ck.pressed[KEY_D], steps[i].a, steps[i].d);
+    }
+
+    // The stick and a key of the axis conflict like two keys
+    input(EV_ABS, ABS_X, 100);
+    key(KEY_A, 1);
+    CHECK(!ck.pressed[KEY_A] && !ck.pressed[KEY_D], "neutral window between the stick and the key");
+    ck.clock = ck.deadline;
+    emit_all();
+    CHECK(ck.pressed[KEY_A] && !ck.pressed[KEY_D], "the key pressed last wins over the stick");
+}
+
+int main(void) {
+    engine.sink = &ck_sink;
+    set_neutral(NEUTRAL_NS);
+    ck.clock = 1000000000;
+
+    check_last();
+    check_first();
+    check_neutral();
+    check_absolute();
+    check_abs();
+
+    if (ck.failures) {
+        printf("engine checks: %d failed\n", ck.failures);
+        return 1;
+    }
+    printf("engine checks: ok\n");
+    return 0;
+}
@@ -0,0 +1,534 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include "engine.h"
+
+static struct stats local_stats;
+
+struct engine engine = {
+    .config = &engine.configs[0],
+    .configs = { {
+        .axes = { // WASD unless a config file is loaded
+            { .keys = { KEY_W, KEY_S }, .policy = POLICY_LAST },
+            { .keys = { KEY_A, KEY_D }, .policy = POLICY_LAST },
+        },
+        .axis_count = 2,
+    } },
+    .out_count = 0,
+    .neutral_ns = 16700000, // ~1 frame at 60 FPS
+    .stats = &local_stats,
+};
+
+static void emit_slots(uint64_t diff, uint64_t out);
+static void emit_diff(uint64_t out);
+
+static uint64_t win_last(void) { return engine.last; }
+static uint64_t win_first(void) { return ~engine.last; } // Both held, so the other one was pressed first
+static uint64_t win_neutral(void) { return 0; }
+static uint64_t win_absolute(void) { return engine.config->priority; }
+
+static const struct {
+    const char *name;
+    uint64_t (*winner)(void);
+    char window; // Goes through a neutral window when the winner changes
+} policies[POLICY_COUNT] = {
+    [POLICY_LAST] = { "last", win_last, 1 },
+    [POLICY_FIRST] = { "first", win_first, 0 },
+    [POLICY_NEUTRAL] = { "neutral", win_neutral, 0 },
+    [POLICY_ABSOLUTE] = { "absolute", win_absolute, 0 },
+};
+
+// Build the lookup tables and policy masks from the configured axes
+void setup_config(struct config *config) {
+    uint64_t masks[POLICY_COUNT] = { 0 };
+    memset(config->key_slots, NO_SLOT, sizeof(config->key_slots));
+    config->priority = config->window_axes = config->abs_slots = 0;
+    for (int a = 0; a < config->axis_count; ++a) {
+        struct axis *axis = &config->axes[a];
+        config->key_slots[axis->keys[0]] = SLOT(a, 0);
+        config->key_slots[axis->keys[1]] = SLOT(a, 1);
+        masks[axis->policy] |= AXIS_BITS(a);
+        if (axis->policy == POLICY_ABSOLUTE) config->priority |= 1ull << SLOT(a, axis->priority);
+        if (policies[axis->policy].window) config->window_axes |= 1ull << SLOT(a, 0);
+    }
+
+    memset(config->abs_index, NO_SLOT, sizeof(config->abs_index));
+    memset(config->axis_abs, NO_SLOT, sizeof(config->axis_abs));
+    for (int i = 0; i < config->abs_count; ++i) {
+        struct abs_source *source = &config->abs[i];
+        config->abs_index[source->code] = (uint8_t)i;
+        for (int side = 0; side < 2; ++side) {
+            source->slots[side] = config->key_slots[source->keys[side]];
+            config->abs_slots |= 1ull << source->slots[side];
+        }
+        config->axis_abs[source->slots[0] / 2] = (uint8_t)i;
+    }
+
+    // resolve() only calls the resolvers of the policies that are actually used
+    config->resolver_count = 0;
+    for (int p = 0; p < POLICY_COUNT; ++p) {
+        if (masks[p]) config->resolvers[config->resolver_count++] = (struct resolver){ policies[p].winner, masks[p] };
+    }
+}
+
+#define K(code) { #code, code }
+static const struct { const char *name; int code; } key_names[] = {
+    K(KEY_A), K(KEY_B), K(KEY_C), K(KEY_D), K(KEY_E), K(KEY_F), K(KEY_G), K(KEY_H), K(KEY_I),
+    K(KEY_J), K(KEY_K), K(KEY_L), K(KEY_M), K(KEY_N), K(KEY_O), K(KEY_P), K(KEY_Q), K(KEY_R),
+    K(KEY_S), K(KEY_T), K(KEY_U), K(KEY_V), K(KEY_W), K(KEY_X), K(KEY_Y), K(KEY_Z),
+    K(KEY_0), K(KEY_1), K(KEY_2), K(KEY_3), K(KEY_4), K(KEY_5), K(KEY_6), K(KEY_7), K(KEY_8), K(KEY_9),
+    K(KEY_UP), K(KEY_DOWN), K(KEY_LEFT), K(KEY_RIGHT),
+    K(KEY_SPACE), K(KEY_ENTER), K(KEY_TAB), K(KEY_ESC), K(KEY_BACKSPACE), K(KEY_CAPSLOCK),
+    K(KEY_LEFTSHIFT), K(KEY_RIGHTSHIFT), K(KEY_LEFTCTRL), K(KEY_RIGHTCTRL), K(KEY_LEFTALT), K(KEY_RIGHTALT),
+    K(KEY_MINUS), K(KEY_EQUAL), K(KEY_LEFTBRACE), K(KEY_RIGHTBRACE), K(KEY_SEMICOLON), K(KEY_APOSTROPHE),
+    K(KEY_GRAVE), K(KEY_BACKSLASH), K(KEY_COMMA), K(KEY_DOT), K(KEY_SLASH),
+    K(KEY_HOME), K(KEY_END), K(KEY_PAGEUP), K(KEY_PAGEDOWN), K(KEY_INSERT), K(KEY_DELETE),
+    K(KEY_KP0), K(KEY_KP1), K(KEY_KP2), K(KEY_KP3), K(KEY_KP4), K(KEY_KP5), K(KEY_KP6), K(KEY_KP7),
+    K(KEY_KP8), K(KEY_KP9), K(KEY_KPMINUS), K(KEY_KPPLUS), K(KEY_KPDOT), K(KEY_KPASTERISK), K(KEY_KPSLASH),
+    K(KEY_F1), K(KEY_F2), K(KEY_F3), K(KEY_F4), K(KEY_F5), K(KEY_F6), K(KEY_F7), K(KEY_F8), K(KEY_F9),
+    K(KEY_F10), K(KEY_F11), K(KEY_F12),
+    K(BTN_DPAD_UP), K(BTN_DPAD_DOWN), K(BTN_DPAD_LEFT), K(BTN_DPAD_RIGHT),
+};
+#undef K
+
+#define A(code) { #code, code }
+static const struct { const char *name; int code; } abs_names[] = {
+    A(ABS_X), A(ABS_Y), A(ABS_Z), A(ABS_RX), A(ABS_RY), A(ABS_RZ), A(ABS_HAT0X), A(ABS_HAT0Y),
+    A(ABS_HAT1X), A(ABS_HAT1Y), A(ABS_MISC),
+};
+#undef A
+
+// Keycode from a name like KEY_W, w or a number, -1 if unknown. Names go first, so 1 is KEY_1 and not
+// the keycode 1 (KEY_ESC).
+int parse_key(const char *name) {
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); ++i) {
+        const char *full = key_names[i].name;
+        if (!strcasecmp(name, full) || (!strncmp(full, "KEY_", 4) && !strcasecmp(name, full + 4))) return key_names[i].code;
+    }
+
+    char *end;
+    long code = strtol(name, &end, 0);
+    if (*name && !*end) return code >= 0 && code <= KEY_MAX ? (int)code : -1;
+    return -1;
+}
+
+// ABS_ code from a name like ABS_X, x or a number, -1 if unknown
+int parse_abs(const char *name) {
+    char *end;
+    long code = strtol(name, &end, 0);
+    if (*name && !*end) return code >= 0 && code <= ABS_MAX ? (int)code : -1;
+
+    for (size_t i = 0; i < sizeof(abs_names) / sizeof(abs_names[0]); ++i) {
+        const char *full = abs_names[i].name;
+        if (!strcasecmp(name, full) || !strcasecmp(name, full + 4)) return abs_names[i].code;
+    }
+    return -1;
+}
+
+// Config file, one pair of opposing keys per line:
+//   axis <key> <key> [last | first | neutral | absolute [<key>]]
+// absolute lets the given key (default the first one) always win.
+// Cleaning can be limited to some applications, one per line:
+//   app <window class or app id>
+// An analog axis can press the keys of an axis, past press percent of its deflection (default 50) and
+// until it falls below release percent (default press), one per axis:
+//   abs <ABS_ code> <key> <key> [press [release]]
+// Everything after a '#' is a comment.
+// Parses into config and builds its tables, on errors returns -1 with the reason in error.
+int parse_config(const char *path, struct config *config, char *error, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        snprintf(error, size, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+#define FAIL(...) do { snprintf(error, size, __VA_ARGS__); fclose(f); return -1; } while (0)
+    char line[256];
+    int line_no = 0;
+    memset(config, 0, sizeof(*config));
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *words[8];
+        int count = 0;
+        for (char *w = strtok(line, " \t\r\n"); w && count < 8; w = strtok(NULL, " \t\r\n")) words[count++] = w;
+        if (count == 0) continue;
+
+        if (!strcmp(words[0], "app") && count == 2) {
+            if (add_app(config, words[1]) < 0) FAIL("%s:%d: more than %d apps", path, line_no, MAX_APPS);
+            continue;
+        }
+        if (!strcmp(words[0], "abs") && count >= 4) {
+            if (config->abs_count == MAX_ABS) FAIL("%s:%d: more than %d analog sources", path, line_no, MAX_ABS);
+            struct abs_source *source = &config->abs[config->abs_count];
+            source->code = parse_abs(words[1]);
+            if (source->code < 0) FAIL("%s:%d: unknown axis '%s'", path, line_no, words[1]);
+            for (int i = 0; i < config->abs_count; ++i) {
+                if (config->abs[i].code == source->code) FAIL("%s:%d: axis '%s' is already used", path, line_no, words[1]);
+            }
+            for (int side = 0; side < 2; ++side) {
+                source->keys[side] = parse_key(words[2 + side]);
+                if (source->keys[side] < 0) FAIL("%s:%d: unknown key '%s'", path, line_no, words[2 + side]);
+            }
+            int press_pct = count > 4 ? atoi(words[4]) : 50, release_pct = count > 5 ? atoi(words[5]) : press_pct;
+            if (press_pct < 1 || press_pct > 100 || release_pct < 0 || release_pct > press_pct) {
+                FAIL("%s:%d: thresholds must be 1-100 percent, release at most press", path, line_no);
+            }
+            source->press_pct = (uint8_t)press_pct;
+            source->release_pct = (uint8_t)release_pct;
+            config->abs_count++;
+            continue;
+        }
+        if (strcmp(words[0], "axis") || count < 3) {
+            FAIL("%s:%d: expected 'axis <key> <key> [policy [key]]', 'abs <axis> <key> <key> [press [release]]' or 'app <name>'",
+                 path, line_no);
+        }
+        if (config->axis_count == MAX_AXES) FAIL("%s:%d: more than %d axes", path, line_no, MAX_AXES);
+
+        struct axis *axis = &config->axes[config->axis_count];
+        *axis = (struct axis){ .policy = POLICY_LAST };
+        for (int side = 0; side < 2; ++side) {
+            int code = parse_key(words[1 + side]);
+            if (code < 0) FAIL("%s:%d: unknown key '%s'", path, line_no, words[1 + side]);
+            for (int a = 0; a < config->axis_count; ++a) {
+                if (config->axes[a].keys[0] == code || config->axes[a].keys[1] == code) code = -1;
+            }
+            if (code < 0 || (side == 1 && code == axis->keys[0])) {
+                FAIL("%s:%d: key '%s' is already bound", path, line_no, words[1 + side]);
+            }
+            axis->keys[side] = code;
+        }
+        if (count > 3) {
+            axis->policy = -1;
+            for (int p = 0; p < POLICY_COUNT; ++p) {
+                if (!strcmp(words[3], policies[p].name)) axis->policy = p;
+            }
+            if (axis->policy < 0) FAIL("%s:%d: unknown policy '%s'", path, line_no, words[3]);
+        }
+        if (count > 4) {
+            int code = parse_key(words[4]);
+            if (axis->policy != POLICY_ABSOLUTE || (code != axis->keys[0] && code != axis->keys[1])) {
+                FAIL("%s:%d: '%s' is not a key of this axis with policy absolute", path, line_no, words[4]);
+            }
+            axis->priority = code == axis->keys[1];
+        }
+        config->axis_count++;
+    }
+    fclose(f);
+#undef FAIL
+
+    if (config->axis_count == 0) {
+        snprintf(error, size, "%s: no axes configured", path);
+        return -1;
+    }
+    // The keys of an analog source have to be opposing keys of one axis, wherever it is configured
+    for (int i = 0; i < config->abs_count; ++i) {
+        const struct abs_source *source = &config->abs[i];
+        int found = 0;
+        for (int a = 0; a < config->axis_count; ++a) {
+            const int *keys = config->axes[a].keys;
+            found |= (keys[0] == source->keys[0] && keys[1] == source->keys[1]) ||
+                     (keys[0] == source->keys[1] && keys[1] == source->keys[0]);
+        }
+        if (!found) {
+            snprintf(error, size, "%s: the keys of analog source %d are not the two keys of one axis", path, i + 1);
+            return -1;
+        }
+        // The sources of a device share its holder bit, and the gamepad writes one code per axis
+        for (int j = 0; j < i; ++j) {
+            const int *keys = config->abs[j].keys;
+            if (keys[0] == source->keys[0] || keys[0] == source->keys[1]) {
+                snprintf(error, size, "%s: analog sources %d and %d press the same axis, one source per axis", path, j + 1, i + 1);
+                return -1;
+            }
+        }
+    }
+    setup_config(config);
+    return 0;
+}
+
+// Load the startup config, exits on errors
+void load_config(const char *path) {
+    char error[PATH_MAX + 128];
+    if (parse_config(path, engine.config, error, sizeof(error)) < 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+}
+
+// The config buffer not in use, a new config is parsed into it while the engine keeps running
+struct config *spare_config() {
+    return &engine.configs[engine.config == &engine.configs[0]];
+}
+
+// Release every key written, cleaned or forwarded, in one frame. With a config only the forwarded keys
+// it cleans are released, NULL releases them all.
+static void release_output(const struct config *config) {
+    emit_diff(0);
+    for (int d = 0; d < MAX_DEVICES; ++d) {
+        for (int code = 0; code <= KEY_MAX; code++) {
+            unsigned char *forwarded = &engine.forwarded[d][code / 8];
+            if (!(*forwarded & (1 << (code % 8))) || (config && config->key_slots[code] == NO_SLOT)) continue;
+            *forwarded &= ~(1 << (code % 8));
+            emit(EV_KEY, code, 0);
+        }
+    }
+    flush_events();
+}
+
+// Shutting down, nothing stays pressed
+void release_all() {
+    release_output(NULL);
+}
+
+// Switch to a new config between two frames. Keys bound differently can't carry their state over, so
+// everything written is released and the new config starts from nothing held, like a fresh start.
+void use_config(struct config *config) {
+    // Forwarded keys the new config cleans would never see their release forwarded
+    release_output(config);
+
+    engine.config = config;
+    memset(engine.state, 0, sizeof(engine.state));
+    engine.held = engine.last = engine.out = engine.neutral = 0;
+    STAT_ADD(engine.stats->reloads, 1);
+}
+
+// Press or release key slot i for one holder, a device's key or its analog source
+static void hold(int i, uint16_t holder, int down, uint64_t time) {
+    struct axis_state *axis = &engine.state[i / 2];
+    int side = i % 2;
+    if (down) {
+        if ((engine.held >> (i ^ 1) & ~engine.held >> i) & 1) STAT_ADD(engine.stats->conflicts, 1);
+        axis->holders[side] |= holder;
+        // Last input priority is tracked per axis. Devices complete independently, so a press that
+        // happened before the one already seen on another device must not take over.
+        if (time >= axis->last_time) {
+            engine.last = (engine.last & ~AXIS_BITS(i / 2)) | 1ull << i;
+            axis->last_time = time;
+        }
+    } else {
+        axis->holders[side] &= ~holder;
+    }
+    engine.held = (engine.held & ~(1ull << i)) | (uint64_t)(axis->holders[side] != 0) << i;
+
+    if (engine.bypass && engine.passthrough && ((engine.held ^ engine.out) >> i & 1)) {
+        // Not cleaning, the grabbed key goes through as it is and emit_all() has nothing to do
+        engine.out ^= 1ull << i;
+        emit_slots(1ull << i, engine.out);
+    }
+}
+
+// An analog source holds a side while it is deflected that way past its threshold. The range of the
+// device centers the axis, the press and release thresholds give it hysteresis.
+static void process_abs(int dev, const struct input_event *ev, uint64_t time) {
+    int s = ev->code < ABS_CNT ? engine.config->abs_index[ev->code] : NO_SLOT;
+    if (s == NO_SLOT) return;
+    const struct abs_source *source = &engine.config->abs[s];
+    int64_t min = engine.abs_range[dev][ev->code].min, max = engine.abs_range[dev][ev->code].max;
+    if (max <= min) { // Not reported, assume a signed 16 bit axis
+        min = -32768;
+        max = 32767;
+    }
+    // Both doubled, which keeps the center of an even range exact
+    int64_t deflection = 2 * (int64_t)ev->value - (min + max), full = max - min;
+    for (int side = 0; side < 2; ++side) {
+        int i = source->slots[side];
+        int64_t toward = side ? deflection : -deflection;
+        int held = (engine.state[i / 2].holders[i % 2] & ABS_HOLDER(dev)) != 0;
+        int down = toward > 0 && toward * 100 >= (int64_t)(held ? source->release_pct : source->press_pct) * full;
+        if (down != held) hold(i, ABS_HOLDER(dev), down, time);
+    }
+}
+
+void process_event(int dev, const struct input_event *ev) {
+    uint64_t time = (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000;
+    if (ev->type == EV_ABS) {
+        STAT_ADD(engine.stats->events_in, 1);
+        process_abs(dev, ev, time);
+        return;
+    }
+    if (ev->type != EV_KEY) return; // EV_SYN and EV_MSC noise
+
+    STAT_ADD(engine.stats->events_in, 1);
+    int i = ev->code <= KEY_MAX ? engine.config->key_slots[ev->code] : NO_SLOT;
+    if (i == NO_SLOT) {
+        // Forward keys we don't clean unchanged in the same batch
+        if (engine.passthrough && ev->code <= KEY_MAX) {
+            unsigned char *forwarded = &engine.forwarded[dev][ev->code / 8];
+            if (ev->value == 1) *forwarded |= 1 << (ev->code % 8);
+            else if (ev->value == 0) *forwarded &= ~(1 << (ev->code % 8));
+            emit(EV_KEY, ev->code, ev->value);
+        }
+        return;
+    }
+
+    if (ev->value == 2) {
+        // Autorepeat changes nothing, it is only passed on for a key that is pressed on the output
+        if (engine.out >> i & 1 && !(engine.gamepad && engine.config->abs_slots >> i & 1)) emit(EV_KEY, ev->code, 2);
+        return;
+    }
+    if (ev->value == 0 || ev->value == 1) hold(i, 1 << dev, ev->value, time);
+}
+
+// Stage an event, it is only written to the sink on the next flush_events()
+void emit(int type, int code, int value) {
+    if (engine.out_count == OUT_BUF_SIZE - 1) flush_events();
+    engine.out_buf[engine.out_count++] = (struct input_event){ .code = code, .type = type, .value = value, .time = {0, 0} };
+}
+
+// Terminate the staged events with SYN_REPORT and hand them to the sink in one write.
+// Nothing is written when no key changed.
+void flush_events() {
+    if (engine.out_count == 0) return;
+    engine.out_buf[engine.out_count++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+    engine.sink->write(engine.out_buf, engine.out_count);
+    STAT_ADD(engine.stats->events_out, engine.out_count);
+    STAT_ADD(engine.stats->frames_out, 1);
+    engine.out_count = 0;
+}
+
+// Length of the neutral windows taken from now on, windows already running keep their deadline
+void set_neutral(uint64_t ns) {
+    engine.neutral_ns = ns;
+    atomic_store_explicit(&engine.stats->neutral_ns, ns, memory_order_relaxed);
+}
+
+// Hold an axis released for neutral_ns without blocking the source.
+// The sink calls emit_all() again once the deadline passed, which then presses the winner.
+static void start_neutral(int axis, uint64_t now) {
+    engine.state[axis].neutral_until = now + engine.neutral_ns;
+    engine.neutral |= AXIS_BITS(axis);
+    STAT_ADD(engine.stats->neutral_windows, 1);
+    engine.sink->arm_timer(engine.state[axis].neutral_until);
+}
+
+// Resolve every axis at once on the key bitmaps and return the new output bitmap. When both keys of an
+// axis are held the winner of its policy is emitted. With last input priority the axis is released for
+// the neutral window first whenever the winner changes, but not while keys of other axes are held.
+// Only neutral windows starting or ending take the per axis loops, the common case is a handful of bit
+// operations and one call per policy in use.
+uint64_t resolve(uint64_t now) {
+    const struct config *config = engine.config;
+    uint64_t held = engine.held;
+    uint64_t both = held & held >> 1 & AXIS_LO; // Side 0 bit of the axes with both keys held
+    uint64_t conflict = both | both << 1;
+    uint64_t winner = 0;
+    for (int r = 0; r < config->resolver_count; ++r) winner |= config->resolvers[r].winner() & config->resolvers[r].mask;
+    // Held keys, except that a conflict keeps only the winner of its policy
+    uint64_t want = (held & ~conflict) | (conflict & winner);
+
+    // A neutral window ends with the conflict, or at its deadline
+    engine.neutral &= conflict;
+    // Conflicts whose winner differs from what was written go through neutral, unless other axes are
+    // held. Axes already in neutral don't start another one when it ends.
+    uint64_t changed = (want ^ engine.out) & conflict & ~engine.neutral;
+    changed = (changed | changed >> 1) & config->window_axes;
+    for (uint64_t n = engine.neutral & AXIS_LO; n; n &= n - 1) {
+        int a = __builtin_ctzll(n) / 2;
+        if (now >= engine.state[a].neutral_until) engine.neutral &= ~AXIS_BITS(a);
+    }
+
+    if (changed && engine.neutral_ns) {
+        uint64_t active = (held | held >> 1) & AXIS_LO;
+        for (; changed; changed &= changed - 1) {
+            uint64_t bit = changed & -changed;
+            if (!(active & ~bit)) start_neutral(__builtin_ctzll(bit) / 2, now);
+        }
+    }
+    return want & ~engine.neutral;
+}
+
+// Stage the slots in diff as they are in out, releases first so a frame never has both keys of an axis
+// down. With the gamepad the axes of analog sources are written as one gamepad axis each.
+static void emit_slots(uint64_t diff, uint64_t out) {
+    const struct config *config = engine.config;
+    uint64_t pad = engine.gamepad ? diff & config->abs_slots : 0;
+    diff &= ~pad;
+    for (uint64_t up = diff & ~out; up; up &= up - 1) {
+        int slot = __builtin_ctzll(up);
+        emit(EV_KEY, config->axes[slot / 2].keys[slot % 2], 0);
+    }
+    for (uint64_t down = diff & out; down; down &= down - 1) {
+        int slot = __builtin_ctzll(down);
+        emit(EV_KEY, config->axes[slot / 2].keys[slot % 2], 1);
+    }
+    while (pad) {
+        int a = __builtin_ctzll(pad) / 2;
+        const struct abs_source *source = &config->abs[config->axis_abs[a]];
+        int value = out >> source->slots[1] & 1 ? GAMEPAD_RANGE : out >> source->slots[0] & 1 ? -GAMEPAD_RANGE : 0;
+        emit(EV_ABS, source->code, value);
+        pad &= ~AXIS_BITS(a);
+    }
+}
+
+// Stage the keys whose output changes to out
+static void emit_diff(uint64_t out) {
+    emit_slots(out ^ engine.out, out);
+    engine.out = out;
+}
+
+void emit_all() {
+    if (!engine.bypass) emit_diff(resolve(engine.sink->now()));
+    flush_events();
+}
+
+// Switch between cleaning and forwarding as is. When the source is grabbed the output jumps to the
+// keys physically held, otherwise the source reaches applications by itself and ours are released.
+// Going back to cleaning needs nothing, the next emit_all() resolves from the held keys.
+void set_bypass(char on) {
+    if (on == engine.bypass) return;
+    engine.bypass = on;
+    if (!on) return;
+    engine.neutral = 0;
+    emit_diff(engine.passthrough ? engine.held : 0);
+    flush_events();
+}
+
+int add_app(struct config *config, const char *name) {
+    if (config->app_count == MAX_APPS) return -1;
+    snprintf(config->apps[config->app_count++], APP_NAME_LEN, "%s", name);
+    return 0;
+}
+
+int app_allowed(const struct config *config, const char *name) {
+    for (int i = 0; i < config->app_count; ++i) {
+        if (!strcasecmp(config->apps[i], name)) return 1;
+    }
+    return config->app_count == 0;
+}
+
+// Release everything a source device held, used when it goes away
+void release_device(int d) {
+    for (int a = 0; a < engine.config->axis_count; ++a) {
+        struct axis_state *axis = &engine.state[a];
+        axis->holders[0] &= ~(1 << d | ABS_HOLDER(d));
+        axis->holders[1] &= ~(1 << d | ABS_HOLDER(d));
+        engine.held = (engine.held & ~AXIS_BITS(a)) | (uint64_t)(axis->holders[0] != 0) << SLOT(a, 0) |
+                      (uint64_t)(axis->holders[1] != 0) << SLOT(a, 1);
+    }
+
+    unsigned char *forwarded = engine.forwarded[d];
+    for (int code = 0; code <= KEY_MAX; code++) {
+        if (forwarded[code / 8] & (1 << (code % 8))) emit(EV_KEY, code, 0);
+    }
+    memset(forwarded, 0, sizeof(engine.forwarded[d]));
+}
+
+// Range of an analog axis of a source device, before its first event
+void set_abs_range(int dev, int code, int32_t min, int32_t max) {
+    engine.abs_range[dev][code].min = min;
+    engine.abs_range[dev][code].max = max;
+}
+
+// Forget all held and emitted state, keeping the configuration
+void reset_state() {
+    memset(engine.state, 0, sizeof(engine.state));
+    engine.held = engine.last = engine.out = engine.neutral = 0;
+    memset(engine.forwarded, 0, sizeof(engine.forwarded));
+    engine.out_count = 0;
+}
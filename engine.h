@@ -0,0 +1,168 @@
+#ifndef SOCD_ENGINE_H
+#define SOCD_ENGINE_H
+
+#include <linux/input.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SOCD resolution, independent of where events come from and go to.
+// A source feeds process_event() and calls emit_all() once per batch, resolved events go to the sink.
+
+#define MAX_AXES    32 // Opposing key pairs that can be configured
+#define MAX_SLOTS   (MAX_AXES * 2)
+#define MAX_DEVICES 8  // Source devices feeding the engine at the same time
+#define SLOT(axis, side) ((axis) * 2 + (side)) // Key slot of one direction of an axis
+#define NO_SLOT     0xFF // key_slots[] entry of a key that is not cleaned
+#define OUT_BUF_SIZE 64 // Staged output events per frame
+#define MAX_APPS    16 // Applications in the allowlist
+#define APP_NAME_LEN 64
+#define AXIS_LO     0x5555555555555555ull // Side 0 bit of every axis in a key bitmap
+#define AXIS_BITS(axis) (3ull << SLOT(axis, 0)) // Both bits of an axis in a key bitmap
+#define MAX_ABS     8  // Analog sources that can be configured
+#define ABS_HOLDER(dev) (1 << (MAX_DEVICES + (dev))) // Holder bit of the analog sources of a device
+#define GAMEPAD_RANGE 32767 // Full deflection of the virtual gamepad axes
+#define CACHE_LINE  64
+#define STATS_MAGIC 0x736f6364 // "socd", first word of an exported struct stats
+#define STATS_VERSION 2 // Bumped whenever the layout of struct stats changes
+#define BATCH_BUCKETS 8 // Histogram buckets of 1, 2-3, 4-7, ... 128 and more
+
+// How an axis resolves both keys being held
+enum {
+    POLICY_LAST, // Last input priority, with a neutral window when the winner changes
+    POLICY_FIRST, // The key held first keeps winning
+    POLICY_NEUTRAL, // Neither key
+    POLICY_ABSOLUTE, // One configured side always wins
+    POLICY_COUNT
+};
+
+// Winner of the conflicting axes of one policy, as a key bitmap (only the bits in mask are used)
+struct resolver {
+    uint64_t (*winner)(void);
+    uint64_t mask; // Both bits of every axis with this policy
+};
+
+// One pair of opposing keys, their slots are SLOT(index, 0) and SLOT(index, 1)
+struct axis {
+    int keys[2]; // Keycodes of the two sides
+    int policy;
+    uint8_t priority; // Side that wins with POLICY_ABSOLUTE
+};
+
+// The hot state of all axes is kept in the key bitmaps of the engine, this is the per axis rest
+struct axis_state {
+    uint64_t neutral_until; // Neutral deadline, valid while the axis is in engine.neutral
+    uint16_t holders[2]; // Devices holding each side: one bit per device for keys, ABS_HOLDER() for analog
+    uint64_t last_time; // Event timestamp of the press that set last
+};
+
+// An analog axis (stick, hat or Hall effect key) pressing one side of a key axis past a threshold
+struct abs_source {
+    int code; // ABS_ code
+    int keys[2]; // Pressed by a negative and by a positive deflection, the two keys of one axis
+    uint8_t slots[2];
+    uint8_t press_pct, release_pct; // Thresholds in percent of the deflection from the center, release_pct <= press_pct
+};
+
+// Everything a config file sets. The engine only reads it through engine.config, a new one is built in
+// the spare buffer and swapped in between two frames by use_config().
+struct config {
+    struct axis axes[MAX_AXES]; // Flat array of the configured pairs
+    int axis_count;
+    uint8_t key_slots[KEY_MAX + 1]; // Keycode to key slot, NO_SLOT when not bound
+    uint64_t priority; // Winning side of every POLICY_ABSOLUTE axis
+    uint64_t window_axes; // Side 0 bit of the axes that take a neutral window
+    struct resolver resolvers[POLICY_COUNT]; // Only the policies in use, chosen once by setup_config()
+    int resolver_count;
+    char apps[MAX_APPS][APP_NAME_LEN]; // Applications to clean in (window class or app id), all when empty
+    int app_count;
+    struct abs_source abs[MAX_ABS];
+    int abs_count;
+    uint8_t abs_index[ABS_CNT]; // ABS_ code to analog source, NO_SLOT when not used
+    uint64_t abs_slots; // Key slots of the analog sources
+    uint8_t axis_abs[MAX_AXES]; // Analog source of each axis, NO_SLOT when none
+};
+
+// Counters, readable from anywhere while they are written. socd can map them into a file under /dev/shm
+// for other processes, so this is a fixed layout: only appended to, with STATS_VERSION bumped. Each
+// group is written by one thread and has cache lines of its own.
+struct stats {
+    uint32_t magic, version; // STATS_MAGIC and STATS_VERSION, magic is written last
+    uint32_t size; // sizeof(struct stats)
+    uint32_t pid; // Of the socd writing it
+    // Engine, written by the thread driving it
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t events_in; // Key and axis events processed
+    atomic_uint_fast64_t events_out, frames_out; // Events and writes handed to the sink
+    atomic_uint_fast64_t conflicts; // Presses of a key while its opposite was held
+    atomic_uint_fast64_t neutral_windows;
+    atomic_uint_fast64_t reloads;
+    // Event loop, written by the thread reading the devices
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t read_errors; // Failed reads of a device
+    atomic_uint_fast64_t short_reads; // Reads that ended in a partial event
+    atomic_uint_fast64_t write_errors; // Frames the virtual devices didn't take
+    atomic_uint_fast64_t submit_errors; // io_uring submissions that failed
+    atomic_uint_fast64_t read_batch[BATCH_BUCKETS]; // Read completions by their number of events
+    atomic_uint_fast64_t cqe_batch[BATCH_BUCKETS]; // Wakeups of the loop by their number of completions
+    // Version 2, gauges written by the engine thread
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t neutral_ns; // Current neutral window
+};
+
+// Single writer counter, a plain add instead of a locked one
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+// Histogram bucket of n, by its highest bit
+#define BATCH_BUCKET(n) ((n) <= 1 ? 0 : 31 - __builtin_clz(n) < BATCH_BUCKETS - 1 ? 31 - __builtin_clz(n) : BATCH_BUCKETS - 1)
+
+// Where resolved events go. The daemon writes to uinput and arms io_uring timeouts,
+// the benchmark records into memory and runs on the clock of the trace.
+struct sink {
+    void (*write)(const struct input_event *events, size_t count); // One frame, ends with SYN_REPORT
+    void (*arm_timer)(uint64_t deadline); // emit_all() has to run again once now() reaches deadline
+    uint64_t (*now)(void); // CLOCK_MONOTONIC nanoseconds, or virtual time
+};
+
+extern struct engine {
+    const struct sink *sink;
+    struct config *config; // Active config, one of configs
+    struct config configs[2];
+    struct axis_state state[MAX_AXES];
+    // Key bitmaps, bit SLOT(axis, side) per key
+    uint64_t held; // Physically held on any device
+    uint64_t last; // Side pressed last, one bit per axis
+    uint64_t out; // State last written to the sink
+    uint64_t neutral; // Axes in their neutral window, both bits
+    char passthrough; // Forward keys that are not cleaned (the source is grabbed)
+    unsigned char forwarded[MAX_DEVICES][KEY_MAX / 8 + 1]; // Keys held through the passthrough
+    uint64_t frame_counter; // Ticks elapsed in tick mode
+    struct input_event out_buf[OUT_BUF_SIZE]; // Output staging buffer, written once per frame
+    int out_count;
+    uint64_t neutral_ns; // Length of the neutral window taken on a SOCD conflict
+    char bypass; // The focused application is not in apps: forward keys as they are, nothing is resolved
+    char gamepad; // Axes with an analog source are written as virtual gamepad axes instead of keys
+    struct { int32_t min, max; } abs_range[MAX_DEVICES][ABS_CNT]; // Reported by the source devices
+    struct stats *stats; // Counters, in memory of their own or mapped for other processes
+} engine;
+
+void setup_config(struct config *config);
+int parse_config(const char *path, struct config *config, char *error, size_t size);
+void load_config(const char *path);
+struct config *spare_config(void);
+void use_config(struct config *config);
+void release_all(void);
+int parse_key(const char *name);
+int parse_abs(const char *name);
+void set_abs_range(int dev, int code, int32_t min, int32_t max);
+void process_event(int dev, const struct input_event *ev);
+void emit(int type, int code, int value);
+void flush_events(void);
+void emit_all(void);
+uint64_t resolve(uint64_t now);
+void release_device(int dev);
+void reset_state(void);
+int add_app(struct config *config, const char *name);
+int app_allowed(const struct config *config, const char *name);
+void set_bypass(char on);
+void set_neutral(uint64_t ns);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <liburing.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include "engine.h"
+
+// Microbenchmarks of the stages of the event path against an in-memory sink: key lookup in
+// process_event(), resolution per policy, batched versus per event output, and intake through
+// io_uring versus read(), with and without an SQPOLL thread. Every stage reports ns/op and cycles/op.
+
+#define AXES        8 // Axes configured for the resolver stages
+#define PATTERN     1024 // Events cycled through by the lookup stages, a power of two
+#define BATCH       8 // Events per frame, and reads per submit for the batched io_uring intake
+#define READ_SIZE   (64 * sizeof(struct input_event)) // One read of the intake stages
+#define PIPE_READS  32 // Reads that fit into the pipe at once
+
+static const char *const policy_names[POLICY_COUNT] = {
+    [POLICY_LAST] = "last", [POLICY_FIRST] = "first", [POLICY_NEUTRAL] = "neutral", [POLICY_ABSOLUTE] = "absolute",
+};
+
+// Time and cycles spent in a stage, accumulated over start/stop pairs
+struct timer {
+    uint64_t ns, cycles;
+};
+
+// Benchmark context
+static struct {
+    long iterations; // Operations per stage
+    int perf_fd; // Cycle counter of this thread, -1 when perf events are not available
+    char tsc; // Without perf events cycles are TSC ticks
+    uint64_t clock;
+    uint64_t out_events;
+    struct input_event events[PATTERN];
+    struct io_uring ring, sqpoll_ring;
+} mb = { .iterations = 1000000, .perf_fd = -1 };
+
+static void mb_write(const struct input_event *events, size_t count) {
+    (void)events;
+    mb.out_events += count;
+}
+
+static void mb_timer(uint64_t deadline) {
+    (void)deadline;
+}
+
+static uint64_t mb_now(void) {
+    return mb.clock;
+}
+
+static const struct sink mb_sink = { .write = mb_write, .arm_timer = mb_timer, .now = mb_now };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Count the cycles of this thread in user space, the stages that make syscalls count only their share
+static void setup_cycles(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE, .size = sizeof(attr), .config = PERF_COUNT_HW_CPU_CYCLES,
+        .exclude_kernel = 1, .exclude_hv = 1,
+    };
+    mb.perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#if defined(__x86_64__) || defined(__i386__)
+    mb.tsc = mb.perf_fd < 0;
+#endif
+}
+
+static uint64_t cycles(void) {
+    uint64_t count = 0;
+    if (mb.perf_fd >= 0 && read(mb.perf_fd, &count, sizeof(count)) == sizeof(count)) return count;
+#if defined(__x86_64__) || defined(__i386__)
+    if (mb.tsc) return __builtin_ia32_rdtsc();
+#endif
+    return 0;
+}
+
+static void timer_start(struct timer *t) {
+    t->ns -= now_ns();
+    t->cycles -= cycles();
+}
+
+static void timer_stop(struct timer *t) {
+    t->cycles += cycles();
+    t->ns += now_ns();
+}
+
+static void report(const char *name, const struct timer *t, long ops) {
+    if (mb.perf_fd < 0 && !mb.tsc) {
+        printf("%-36s %9.2f ns/op\n", name, (double)t->ns / ops);
+        return;
+    }
+    printf("%-36s %9.2f ns/op %9.1f cycles/op\n", name, (double)t->ns / ops, (double)t->cycles / ops);
+}
+
+// AXES axes on the letter keys, all with one policy
+static void use_policy(int policy) {
+    static const int keys[AXES * 2] = {
+        KEY_W, KEY_S, KEY_A, KEY_D, KEY_I, KEY_K, KEY_J, KEY_L, KEY_T, KEY_G, KEY_F, KEY_H, KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT
+    };
+    struct config *config = engine.config;
+    memset(config, 0, sizeof(*config));
+    for (int a = 0; a < AXES; ++a) config->axes[a] = (struct axis){ .keys = { keys[2 * a], keys[2 * a + 1] }, .policy = policy };
+    config->axis_count = AXES;
+    setup_config(config);
+    reset_state();
+}
+
+// process_event() on presses and releases of cleaned keys, or on keys it only looks up and skips
+static void bench_lookup(void) {
+    for (int cleaned = 1; cleaned >= 0; --cleaned) {
+        use_policy(POLICY_LAST);
+        uint32_t seed = 1;
+        char held[KEY_MAX + 1] = { 0 };
+        for (int i = 0; i < PATTERN; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            int code = cleaned ? engine.config->axes[(seed >> 8) % AXES].keys[(seed >> 16) & 1] : KEY_1 + (int)((seed >> 8) % 10);
+            held[code] ^= 1;
+            mb.events[i] = (struct input_event){ .type = EV_KEY, .code = code, .value = held[code] };
+        }
+
+        struct timer t = { 0 };
+        timer_start(&t);
+        for (long i = 0; i < mb.iterations; ++i) process_event(0, &mb.events[i & (PATTERN - 1)]);
+        timer_stop(&t);
+        report(cleaned ? "process_event, cleaned key" : "process_event, other key", &t, mb.iterations);
+    }
+}
+
+// resolve() with every axis in conflict and the last pressed side flipping on every call, so the winner
+// of the policies that follow it changes each time
+static void bench_resolve(void) {
+    uint64_t neutral_ns = engine.neutral_ns;
+    engine.neutral_ns = 0; // Windows would hold the axes released and skip the winners
+    for (int p = 0; p < POLICY_COUNT; ++p) {
+        use_policy(p);
+        engine.held = ~0ull >> (64 - 2 * AXES);
+        engine.last = engine.held & AXIS_LO;
+
+        char name[64];
+        snprintf(name, sizeof(name), "resolve, %d axes %s", AXES, policy_names[p]);
+        struct timer t = { 0 };
+        uint64_t sum = 0;
+        timer_start(&t);
+        for (long i = 0; i < mb.iterations; ++i) {
+            engine.last ^= engine.held;
+            engine.out = resolve(mb.clock);
+            sum += engine.out;
+        }
+        timer_stop(&t);
+        if (sum == 1) printf("%llu\n", (unsigned long long)sum); // Keeps the loop from being dropped
+        report(name, &t, mb.iterations);
+    }
+    engine.neutral_ns = neutral_ns;
+    reset_state();
+}
+
+// BATCH events written in one frame against one frame per event, per event
+static void bench_emit(void) {
+    struct timer batched = { 0 }, single = { 0 };
+    long frames = mb.iterations / BATCH;
+    timer_start(&batched);
+    for (long i = 0; i < frames; ++i) {
+        for (int e = 0; e < BATCH; ++e) emit(EV_KEY, KEY_W + e, (int)(i & 1));
+        flush_events();
+    }
+    timer_stop(&batched);
+    char name[64];
+    snprintf(name, sizeof(name), "emit, %d per frame", BATCH);
+    report(name, &batched, frames * BATCH);
+
+    timer_start(&single);
+    for (long i = 0; i < frames * BATCH; ++i) {
+        emit(EV_KEY, KEY_W, (int)(i & 1));
+        flush_events();
+    }
+    timer_stop(&single);
+    report("emit, 1 per frame", &single, frames * BATCH);
+}
+
+// Reads of READ_SIZE from a pipe kept filled, the refills are not timed. depth 0 uses read(), otherwise
+// depth reads are submitted to ring at once.
+static void bench_intake(int depth, struct io_uring *ring, const char *kind) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    static char buf[PIPE_READS][READ_SIZE];
+    memset(buf, 0, sizeof(buf));
+    long reads = mb.iterations / 10; // Syscalls, a tenth of the iterations is plenty
+    reads -= reads % PIPE_READS;
+    struct timer t = { 0 };
+    for (long done = 0; done < reads; done += PIPE_READS) {
+        for (int i = 0; i < PIPE_READS; ++i) {
+            if (write(fds[1], buf[i], READ_SIZE) != (ssize_t)READ_SIZE) {
+                perror("write");
+                exit(1);
+            }
+        }
+        timer_start(&t);
+        if (!depth) {
+            for (int i = 0; i < PIPE_READS; ++i) {
+                if (read(fds[0], buf[i], READ_SIZE) != (ssize_t)READ_SIZE) exit(1);
+            }
+        } else {
+            for (int i = 0; i < PIPE_READS; i += depth) {
+                // Linked, so the reads of the pipe complete in order
+                for (int j = 0; j < depth; ++j) {
+                    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+                    io_uring_prep_read(sqe, fds[0], buf[i + j], READ_SIZE, 0);
+                    if (j + 1 < depth) sqe->flags |= IOSQE_IO_LINK;
+                }
+                io_uring_submit_and_wait(ring, depth);
+                struct io_uring_cqe *cqe;
+                for (int j = 0; j < depth; ++j) {
+                    if (io_uring_wait_cqe(ring, &cqe) < 0 || cqe->res != (int)READ_SIZE) exit(1);
+                    io_uring_cqe_seen(ring, cqe);
+                }
+            }
+        }
+        timer_stop(&t);
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    char name[64];
+    if (depth) snprintf(name, sizeof(name), "intake, %s %d per submit", kind, depth);
+    else snprintf(name, sizeof(name), "intake, read()");
+    report(name, &t, reads);
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [options]\n"
+           "  -n, --iterations N  operations per stage (default 1000000)\n"
+           "  -h, --help          show this help\n", name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "iterations", required_argument, NULL, 'n' },
+        { "help",       no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            mb.iterations = atol(optarg);
+            if (mb.iterations < PIPE_READS * 10) {
+                fprintf(stderr, "At least %d iterations\n", PIPE_READS * 10);
+                exit(1);
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    engine.sink = &mb_sink;
+    setup_cycles();
+    if (mb.perf_fd < 0) printf(mb.tsc ? "No perf events, cycles are TSC ticks\n" : "No cycle counter\n");
+
+    bench_lookup();
+    bench_resolve();
+    bench_emit();
+    bench_intake(0, NULL, NULL);
+    if (io_uring_queue_init(BATCH * 2, &mb.ring, 0) < 0) {
+        printf("No io_uring, skipping its intake\n");
+        return 0;
+    }
+    bench_intake(1, &mb.ring, "io_uring");
+    bench_intake(BATCH, &mb.ring, "io_uring");
+    io_uring_queue_exit(&mb.ring);
+
+    // What --sqpoll changes: submissions are picked up by a kernel thread instead of io_uring_enter()
+    struct io_uring_params params = { .flags = IORING_SETUP_SQPOLL, .sq_thread_idle = 100 };
+    if (io_uring_queue_init_params(BATCH * 2, &mb.sqpoll_ring, &params) < 0) {
+        printf("No SQPOLL (needs root on older kernels), skipping its intake\n");
+        return 0;
+    }
+    bench_intake(1, &mb.sqpoll_ring, "SQPOLL");
+    bench_intake(BATCH, &mb.sqpoll_ring, "SQPOLL");
+    io_uring_queue_exit(&mb.sqpoll_ring);
+}
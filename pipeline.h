@@ -0,0 +1,86 @@
+#ifndef SOCD_PIPELINE_H
+#define SOCD_PIPELINE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Lock-free single producer, single consumer ring of key transitions between the reader thread (the
+// io_uring loop) and the emitter thread that resolves and writes (--split). Producer and consumer
+// state live on their own cache lines, the producer publishes once per batch and only makes a syscall
+// when the emitter went to sleep.
+
+#define PIPE_SIZE 4096 // Transitions in flight, a power of two
+
+enum {
+    TR_KEY, // EV_KEY event of a source device
+    TR_ABS, // EV_ABS event of a source device
+    TR_SYNC, // End of a read batch, resolve and write
+    TR_TICK, // value ticks elapsed (tick mode)
+    TR_RELEASE, // Source device went away, release what it held
+    TR_BYPASS, // value: the focused application is not cleaned
+    TR_CONFIG, // Switch to the spare config, a reload parsed it
+    TR_NEUTRAL, // time: new neutral window length
+    TR_STOP // Shut the emitter down
+};
+
+struct transition {
+    uint64_t time; // Event timestamp, nanoseconds
+    int32_t value;
+    uint16_t code;
+    uint8_t dev;
+    uint8_t kind;
+};
+
+struct pipe {
+    _Alignas(64) atomic_size_t head; // Published by the producer
+    size_t next; // Producer: next slot to fill, published on pipe_publish()
+    size_t tail_cache; // Producer: last tail seen
+    _Alignas(64) atomic_size_t tail; // Released by the consumer
+    _Alignas(64) atomic_uint waiting; // Consumer is (about to be) asleep on this futex
+    _Alignas(64) struct transition ring[PIPE_SIZE];
+};
+
+static inline long pipe_futex(atomic_uint *word, int op, unsigned int val, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+// Make the queued transitions visible and wake the consumer if it sleeps
+static inline void pipe_publish(struct pipe *p) {
+    atomic_store_explicit(&p->head, p->next, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst); // Pairs with the fence in pipe_wait()
+    if (atomic_load_explicit(&p->waiting, memory_order_relaxed)) {
+        atomic_store_explicit(&p->waiting, 0, memory_order_relaxed);
+        pipe_futex(&p->waiting, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+// Queue one transition. Transitions can't be dropped without corrupting the key state, so a full
+// ring publishes what it has and waits for the consumer, yielding so a consumer on the same core (at
+// the same SCHED_FIFO priority) gets to run.
+static inline void pipe_push(struct pipe *p, struct transition tr) {
+    while (p->next - p->tail_cache == PIPE_SIZE) {
+        p->tail_cache = atomic_load_explicit(&p->tail, memory_order_acquire);
+        if (p->next - p->tail_cache == PIPE_SIZE) {
+            pipe_publish(p);
+            sched_yield();
+        }
+    }
+    p->ring[p->next & (PIPE_SIZE - 1)] = tr;
+    p->next++;
+}
+
+// Sleep until something is published or timeout passes (NULL waits forever)
+static inline void pipe_wait(struct pipe *p, size_t tail, const struct timespec *timeout) {
+    atomic_store_explicit(&p->waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&p->head, memory_order_relaxed) == tail) pipe_futex(&p->waiting, FUTEX_WAIT_PRIVATE, 1, timeout);
+    atomic_store_explicit(&p->waiting, 0, memory_order_relaxed);
+}
+
+#endif
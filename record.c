@@ -0,0 +1,89 @@
+#define _GNU_SOURCE // SCHED_IDLE
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "record.h"
+
+struct recorder recorder;
+
+static int record_fd = -1;
+static pthread_t writer;
+static atomic_bool stopping;
+
+static void write_all(const void *data, size_t size) {
+    const char *p = data;
+    while (size) {
+        ssize_t n = write(record_fd, p, size);
+        if (n < 0) {
+            perror("Failed to write the recording");
+            return;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+}
+
+// Write out everything between tail and head, at most two writes when the ring wrapped
+static void drain(size_t head) {
+    size_t tail = atomic_load_explicit(&recorder.tail, memory_order_relaxed);
+    while (tail != head) {
+        size_t start = tail & (RECORD_RING - 1);
+        size_t count = head - tail;
+        if (count > RECORD_RING - start) count = RECORD_RING - start;
+        write_all(&recorder.records[start], count * sizeof(struct trace_record));
+        tail += count;
+        atomic_store_explicit(&recorder.tail, tail, memory_order_release);
+    }
+}
+
+// Polls instead of being woken, so the event loop never makes a syscall for the recording
+static void *writer_main(void *arg) {
+    (void)arg;
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    int idle = 0;
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        size_t head = atomic_load_explicit(&recorder.head, memory_order_acquire);
+        size_t pending = head - atomic_load_explicit(&recorder.tail, memory_order_relaxed);
+        // Write in large chunks, or whatever is there once the loop was quiet for a while
+        if (pending >= RECORD_CHUNK || (pending && ++idle >= 10)) {
+            drain(head);
+            idle = 0;
+            continue;
+        }
+        struct timespec wait = {0, 10000000}; // 10 ms
+        nanosleep(&wait, NULL);
+    }
+    drain(atomic_load_explicit(&recorder.head, memory_order_acquire));
+    return NULL;
+}
+
+void record_start(const char *path) {
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (record_fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    struct trace_header header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .record_size = sizeof(struct trace_record) };
+    write_all(&header, sizeof(header));
+
+    if (pthread_create(&writer, NULL, writer_main, NULL)) {
+        fprintf(stderr, "Failed to start the recording thread\n");
+        exit(1);
+    }
+    recorder.enabled = 1;
+}
+
+void record_stop() {
+    if (!recorder.enabled) return;
+    recorder.enabled = 0;
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    close(record_fd);
+    if (recorder.dropped) fprintf(stderr, "Recording dropped %llu events, the writer fell behind\n", (unsigned long long)recorder.dropped);
+}
@@ -0,0 +1,44 @@
+#ifndef SOCD_RECORD_H
+#define SOCD_RECORD_H
+
+#include <linux/input.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "trace.h"
+
+// Recording of input and output events into a trace file. The event loop only copies records into a
+// preallocated ring, a low priority writer thread drains it to disk in large sequential writes.
+
+#define RECORD_RING  (1 << 16) // Records buffered between the event loop and the writer, a power of two
+#define RECORD_CHUNK 4096 // Records the writer waits for before writing, unless the loop went quiet
+
+extern struct recorder {
+    char enabled;
+    _Alignas(64) atomic_size_t head; // Next record to fill, only written by the event loop
+    size_t tail_cache; // Last tail seen by the event loop, saves touching the writer's cache line
+    uint64_t dropped; // Records lost because the ring was full
+    _Alignas(64) atomic_size_t tail; // Next record to write out, only written by the writer thread
+    _Alignas(64) struct trace_record records[RECORD_RING];
+} recorder;
+
+void record_start(const char *path);
+void record_stop(void);
+
+// Queue one event, tag is the source device or TRACE_OUTPUT. Never blocks, drops when the ring is full.
+static inline void record_event(uint8_t tag, uint64_t time, const struct input_event *ev) {
+    size_t head = atomic_load_explicit(&recorder.head, memory_order_relaxed);
+    if (head - recorder.tail_cache == RECORD_RING) {
+        recorder.tail_cache = atomic_load_explicit(&recorder.tail, memory_order_acquire);
+        if (head - recorder.tail_cache == RECORD_RING) {
+            recorder.dropped++;
+            return;
+        }
+    }
+    recorder.records[head & (RECORD_RING - 1)] = (struct trace_record){
+        .time = time, .value = ev->value, .code = ev->code, .type = ev->type, .tag = tag
+    };
+    atomic_store_explicit(&recorder.head, head + 1, memory_order_release);
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sched_setaffinity
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -6,131 +7,928 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <dirent.h>
 #include <termios.h>
 #include <liburing.h>
 #include <stdatomic.h>
 #include <time.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glob.h>
+#include "engine.h"
+#include "record.h"
+#include "pipeline.h"
+#include <pthread.h>
 
-#define UP     0
-#define LEFT   1
-#define DOWN   2
-#define RIGHT  3
-#define KEY_COUNT 4
+#define DEFAULT_CONFIG "/etc/socd.conf"
+#define DEVICE_CACHE_DIR "/var/cache/socd"
+#define DEVICE_CACHE     DEVICE_CACHE_DIR "/devices" // Devices picked last time, one path per line
+#define STACK_PREFAULT (256 * 1024) // Stack touched up front with --mlock
+#define READ_DEPTH  8  // Read buffers kept queued on the ring per device
+#define READ_BUFS   (MAX_DEVICES * READ_DEPTH)
+#define MULTISHOT_IDX 0xFFFF // Buffer index in the tag of a multishot read
+#define ALL_READS   ((1u << READ_DEPTH) - 1)
+#define HOTPLUG_EVENTS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) // udev renames its symlinks into place
+#define READ_EVENTS 64 // Events per read buffer
+#define CQE_BATCH   32 // Completions reaped per wakeup
+#define READ_BGID   0  // Provided buffer group for multishot reads
+#define WRITE_BUFS  32 // Frames that can be waiting for their write to the virtual device
+#define WRITE_DRAIN_NS 1000000 // Longest wait for the queued frames to be taken before writing directly
+#define WRITE_FILE  MAX_DEVICES // Registered file of the virtual device, devices use their index
+#define GAMEPAD_FILE (MAX_DEVICES + 1) // Registered file of the virtual gamepad
+#define FILE_SLOTS  (MAX_DEVICES + 2)
+#define TIMER_SLOTS (MAX_AXES + MAX_DEVICES + 1) // Timeouts that can be waiting for submission
+#define BACKOFF_MIN_NS 1000000ull // First retry after an error, doubles up to BACKOFF_MAX_SHIFT times
+#define BACKOFF_MAX_SHIFT 10
+#define CONTROL_LINE 1024 // Longest control command
+#define CONTROL_REPLY 4096
+
+// Log-linear latency histogram: HIST_SUB linear buckets per power of two
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
 
 #define result_msg(call, fmt, ...) \
     do { if ((call) < 0) { perror(fmt); exit(1); } } while (0)
 #define result(call) result_msg(call, "call failed")
 
-struct keystate { char pressed; int which; };
+// What to do about a failed operation
+enum {
+    ERR_RETRY, // Transient, try again
+    ERR_DEVICE, // The device went away or broke, recover through hotplug
+    ERR_FATAL // Won't go away by itself
+};
+
+// Completion tags stored in the io_uring user_data: op, source device and read buffer index
+enum { OP_READ, OP_TIMEOUT, OP_HOTPLUG, OP_CANCEL, OP_TICK, OP_FOCUS, OP_ACCEPT, OP_COMMAND, OP_REPLY, OP_SIGNAL, OP_WRITE, OP_FRAMETIME };
+
+// Compositors the focused application is followed on
+enum { FOCUS_HYPRLAND, FOCUS_SWAY };
+#define SWAY_IPC_MAGIC "i3-ipc"
+#define SWAY_HEADER    14 // Magic, payload length and type
+#define SWAY_SUBSCRIBE 2
+#define SWAY_EVENT_WINDOW 0x80000003u
+#define FRAME_MIN_NS   1000000 // Frame times outside of these are loading screens or noise, not frames
+#define FRAME_MAX_NS   200000000
+#define FRAME_AVG_SHIFT 3 // Frame time average over ~8 frames
+#define FRAME_DEV_SHIFT 2 // Its deviation over ~4
+#define TAG(op, dev, idx) ((uint64_t)(op) | (uint64_t)(dev) << 8 | (uint64_t)(idx) << 16)
+#define TAG_OP(tag)  ((tag) & 0xff)
+#define TAG_DEV(tag) (((tag) >> 8) & 0xff)
+#define TAG_IDX(tag) ((tag) >> 16)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Backoff and log rate limit of something that can keep failing
+struct retry {
+    uint64_t at; // No new attempt before this time, 0 when not backing off
+    unsigned int failures; // Consecutive failures, reset on success
+    uint64_t log_next; // Next time a message may be logged
+    unsigned int suppressed; // Messages dropped since the last one logged
+};
+
+// A source keyboard, its read buffers are read_bufs[index * READ_DEPTH ...]
+struct device {
+    char path[275];
+    int fd; // -1 while the device is unplugged
+    int wd; // inotify watch on the directory of path, -1 while the directory is gone
+    int parent_wd; // Watch on the directory above, udev removes an empty by-id and creates it again
+    uint32_t idle_reads; // Bitmask of read buffers not queued on the ring
+    char multishot_armed;
+    char lost, reopen; // lost: unplugged, fd is closed once no read is in flight. reopen: open again when possible
+    struct retry retry; // Read and open errors
+};
+
+// Lock-free histogram, written by the event loop and readable from anywhere
+struct histogram {
+    atomic_uint_fast64_t buckets[HIST_BUCKETS];
+    atomic_uint_fast64_t count, max;
+};
 
 // Global context structure
 static struct {
-    char *wr_target, rd_target[275], running;
-    int write_fd, read_fd;
-    atomic_int rl_keystates[KEY_COUNT]; // Using atomic variables
-    struct keystate vr_keystates[KEY_COUNT];
-    atomic_int last_pressed; // Variable for storing the last pressed key index
-    int frame_counter; // Frame counter to manage the neutral state
+    char *wr_target, running;
+    int write_fd;
+    struct device devices[MAX_DEVICES];
+    int device_count;
+    char all_devices; // Use every keyboard found instead of asking
+    char no_cache; // Don't use or update DEVICE_CACHE
+    int match_vendor, match_product; // --id filter, -1 when not set
+    char *match_phys; // --phys filter, a glob
+    int inotify_fd; // Watches the device directories for hotplug
+    char inotify_armed;
+    struct retry hotplug_retry, submit_retry, control_retry;
+    char inotify_buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *config_path;
+    struct __kernel_timespec timer_ts[TIMER_SLOTS]; // Absolute timeouts, read by the kernel on submission
+    int timer_next;
+    struct input_event read_bufs[READ_BUFS][READ_EVENTS]; // Registered read buffers
+    struct input_event write_bufs[WRITE_BUFS][OUT_BUF_SIZE]; // Registered after the read buffers
+    uint32_t idle_writes; // Bitmask of write buffers not in flight
+    char fixed_files; // Devices and the virtual device are registered files, addressed by their slot
+    char ring_writes; // Frames are written through the ring instead of write()
+    char buffers_registered;
+    struct retry write_retry;
+    struct io_uring_buf_ring *buf_ring; // Provided buffers when multishot reads are used
+    char multishot, multishot_ok; // multishot_ok: a multishot read delivered data at least once
+    char sqpoll, busy_poll; // Low latency modes, both trade a core for fewer syscalls and wakeups
+    int sq_cpu; // CPU the SQPOLL thread is pinned to, -1 for no pinning
+    unsigned int sq_idle_ms; // Time the SQPOLL thread spins before sleeping
+    char latency; // Record input timestamp to uinput write latency
+    uint64_t lat_pending[CQE_BATCH * READ_EVENTS]; // Input timestamps of the batch being processed
+    int lat_count;
+    uint64_t lat_writing[CQE_BATCH * READ_EVENTS]; // Input timestamps whose frame is queued on the ring
+    int lat_writing_count;
+    int lat_write; // Write buffer of that frame, its completion records them
+    int last_write; // Write buffer queued last, -1 when the batch queued none
+    struct histogram lat_hist;
+    char kernel_repeat; // The virtual device repeats held keys itself, repeats of the sources are dropped
+    char grab; // Exclusively grab the keyboard and forward its other keys through the virtual device
+    int rt_prio; // SCHED_FIFO priority of the event loop, 0 to keep SCHED_OTHER
+    int cpu; // CPU the event loop is pinned to, -1 for no pinning
+    char mlock; // Lock and pre-fault all memory so the loop never page-faults
+    char *record_path; // Trace file input and output events are recorded to
+    double tick_hz; // Flush the resolved state at this rate instead of after every read, 0 when off
+    uint64_t tick_ns;
+    int neutral_ticks; // Neutral window in tick mode
+    int tick_fd; // Periodic timerfd driving the ticks
+    uint64_t tick_expirations; // Read buffer of the timerfd
+    char tick_armed, ticked;
+    char split; // Resolve and write on an emitter thread, fed by the io_uring loop through pipe
+    int emit_cpu; // CPU the emitter thread is pinned to, -1 to inherit the loop's
+    struct pipe pipe;
+    uint64_t pending_ticks; // Ticks not handed to the emitter yet
+    uint64_t emit_deadline; // Emitter: next neutral deadline, 0 when none
+    struct histogram queue_hist; // Input timestamp to emitter, the reader's share of the latency
+    pthread_t emitter;
+    int focus_fd; // Compositor event socket, -1 when not following the focus
+    int focus_kind;
+    char focus_armed;
+    char focus_buf[65536]; // Unparsed compositor events
+    size_t focus_len;
+    uint32_t focus_skip; // Bytes left of a sway event too large for focus_buf
+    char focused; // focus_app holds the focused application
+    char *frametime_path; // Frame time feed, NULL when there is none
+    int frametime_fd;
+    char frametime_armed;
+    char frametime_buf[1024]; // Unparsed frame times, up to a newline
+    size_t frametime_len;
+    uint64_t frame_avg_ns, frame_dev_ns; // Average frame time of the feed and its mean deviation, 0 before the first
+    uint64_t fixed_frame_ns; // Frame time set through the control socket, wins over the feed, 0 when unset
+    char focus_app[APP_NAME_LEN];
+    char *cli_apps[MAX_APPS]; // --app, added to every config loaded
+    int cli_app_count;
+    struct config *config; // Config last loaded: the active one, or the one the emitter is about to switch to
+    atomic_bool config_pending; // --split: a reloaded config waits for the emitter, the spare buffer is taken
+    unsigned char key_bits[KEY_MAX / 8 + 1]; // Keys the virtual device can send
+    int gamepad_fd; // Virtual gamepad (--gamepad), -1 when there is none
+    uint64_t abs_bits; // Axes the virtual gamepad can send
+    char disabled; // Cleaning turned off through the control socket
+    char *stats_path; // Counters exported through a shared mapping, NULL when they are private
+    char *control_path; // Control socket, NULL when there is none
+    int control_fd; // Listening socket
+    int client_fd; // The one control client served at a time, -1 when none
+    char control_armed; // An accept, receive or send is in flight
+    char command_buf[CONTROL_LINE]; // Received commands, up to a newline
+    size_t command_len;
+    char reply[CONTROL_REPLY]; // Answer being sent to the client
+    size_t reply_len, reply_sent;
+    int signal_fd; // SIGINT, SIGTERM and SIGUSR1, read on the ring
+    char signal_armed;
+    struct signalfd_siginfo siginfo;
 } context = {
     .running = 1,
     .wr_target = "/dev/uinput",
-    .rd_target = { 0 },
-    .rl_keystates = { 0 },
-    .vr_keystates = {
-        { 0, KEY_W },   // UP
-        { 0, KEY_A },   // LEFT
-        { 0, KEY_S },   // DOWN
-        { 0, KEY_D },   // RIGHT
-    },
-    .last_pressed = ATOMIC_VAR_INIT(-1), // Initialize variable
-    .frame_counter = 0 // Initialize frame counter
+    .sq_cpu = -1,
+    .cpu = -1,
+    .inotify_fd = -1,
+    .tick_fd = -1,
+    .emit_cpu = -1,
+    .focus_fd = -1,
+    .frametime_fd = -1,
+    .control_fd = -1,
+    .client_fd = -1,
+    .signal_fd = -1,
+    .last_write = -1,
+    .gamepad_fd = -1,
+    .neutral_ticks = 1,
+    .match_vendor = -1,
+    .match_product = -1,
+    .sq_idle_ms = 1000
 };
 
 const char *BY_ID = "/dev/input/by-id/";
 const char *BY_PATH = "/dev/input/by-path/";
 
-void sigint_handler(int sig);
-void emit(int type, int code, int value);
-void emit_all(void);
+void setup_signals(void);
+void arm_signals(void);
+void handle_signal(const struct io_uring_cqe *cqe);
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_percentile(const struct histogram *h, double p);
+int hist_format(const struct histogram *h, const char *name, char *out, size_t size);
+void hist_dump(const struct histogram *h, const char *name);
+void record_latency(void);
+uint64_t now_ns(void);
+void uinput_write(const struct input_event *events, size_t count);
+void ring_timer(uint64_t deadline);
+void tick_timer(uint64_t deadline);
+uint64_t tick_now(void);
+void setup_tick(void);
+void arm_tick(void);
+void handle_tick(const struct io_uring_cqe *cqe);
+void emitter_timer(uint64_t deadline);
+void start_emitter(void);
+void *emitter_main(void *arg);
+void dump_latency(void);
+void setup_focus(void);
+void arm_focus(void);
+void handle_focus(const struct io_uring_cqe *cqe);
+void focus_changed(const char *app);
+void setup_frametime(void);
+void arm_frametime(void);
+void handle_frametime(const struct io_uring_cqe *cqe);
+void frame_time(uint64_t ns);
+uint64_t update_neutral(void);
+void update_bypass(void);
+void add_cli_apps(struct config *config);
+void setup_control(void);
+void arm_control(void);
+void handle_control(const struct io_uring_cqe *cqe);
+void run_command(char *line);
+void reload_config(const char *path);
+void close_control(void);
+struct io_uring_sqe *get_sqe(void);
 void setup_write(void);
-void process_event(const struct input_event *ev);
+void setup_gamepad(void);
+void setup_stats(void);
+void close_stats(void);
+void grab_keyboard(int fd);
+void setup_reads(void);
+void setup_fixed_reads(void);
+void setup_files(void);
+void update_file(int slot, int fd);
+void setup_buffers(void);
+void handle_write(const struct io_uring_cqe *cqe);
+void drain_writes(void);
+void arm_reads(void);
+void handle_read(const struct io_uring_cqe *cqe);
+void process_event(int dev, const struct input_event *ev);
+void add_device(const char *path);
+int open_device(struct device *dev);
+void setup_hotplug(void);
+void arm_hotplug(void);
+void handle_hotplug(const struct io_uring_cqe *cqe);
+void device_lost(int d);
+void device_error(int d, int err);
+int classify_error(int err);
+void backoff(struct retry *r);
+int retry_due(struct retry *r);
+void log_limited(struct retry *r, const char *fmt, ...);
+void submit_failed(int err);
+void device_found(int d);
+void check_device(int d);
+void setup_realtime(void);
 int get_keyboard(const char *path);
-int prompt_user(int max);
+int match_devices(const char *path);
+int load_device_cache(void);
+void save_device_cache(void);
+int prompt_user(char **names, int max);
 struct io_uring ring;
 
-volatile sig_atomic_t running_flag = 1;
+static const struct sink uinput_sink = { .write = uinput_write, .arm_timer = ring_timer, .now = now_ns };
+// Tick mode: the engine runs on tick time, neutral windows end on a tick without a timer of their own
+static const struct sink tick_sink = { .write = uinput_write, .arm_timer = tick_timer, .now = tick_now };
+// --split: the emitter thread waits for its own deadlines
+static const struct sink emitter_sink = { .write = uinput_write, .arm_timer = emitter_timer, .now = now_ns };
+
+static const struct option long_options[] = {
+    { "neutral-ms",  required_argument, NULL, 'n' },
+    { "neutral-fps", required_argument, NULL, 'f' },
+    { "sqpoll",      no_argument,       NULL, 's' },
+    { "sq-cpu",      required_argument, NULL, 'c' },
+    { "sq-idle",     required_argument, NULL, 'i' },
+    { "busy-poll",   no_argument,       NULL, 'b' },
+    { "latency",     no_argument,       NULL, 'l' },
+    { "grab",        no_argument,       NULL, 'g' },
+    { "config",      required_argument, NULL, 'C' },
+    { "device",      required_argument, NULL, 'd' },
+    { "all",         no_argument,       NULL, 'a' },
+    { "id",          required_argument, NULL, 'u' },
+    { "phys",        required_argument, NULL, 'p' },
+    { "no-cache",    no_argument,       NULL, 'N' },
+    { "rt-prio",     required_argument, NULL, 'r' },
+    { "cpu",         required_argument, NULL, 'P' },
+    { "mlock",       no_argument,       NULL, 'm' },
+    { "record",      required_argument, NULL, 'w' },
+    { "tick-rate",   required_argument, NULL, 't' },
+    { "neutral-ticks", required_argument, NULL, 'T' },
+    { "split",       no_argument,       NULL, 'x' },
+    { "app",         required_argument, NULL, 'A' },
+    { "emit-cpu",    required_argument, NULL, 'E' },
+    { "control",     required_argument, NULL, 'o' },
+    { "kernel-repeat", no_argument,     NULL, 'R' },
+    { "gamepad",     no_argument,       NULL, 'J' },
+    { "stats",       required_argument, NULL, 'S' },
+    { "frametime",   required_argument, NULL, 'F' },
+    { "help",        no_argument,       NULL, 'h' },
+    { 0 }
+};
+
+static void usage(const char *name) {
+    printf("Usage: %s [options]\n"
+           "  -n, --neutral-ms MS    neutral window on a SOCD conflict in ms (default 16.7, 0 disables)\n"
+           "  -f, --neutral-fps FPS  neutral window of one frame at FPS\n"
+           "  -s, --sqpoll           submit through a kernel SQPOLL thread instead of io_uring_enter\n"
+           "  -c, --sq-cpu CPU       pin the SQPOLL thread to CPU\n"
+           "  -i, --sq-idle MS       time the SQPOLL thread spins before sleeping (default 1000)\n"
+           "  -b, --busy-poll        busy-spin on the completion queue instead of waiting\n"
+           "  -l, --latency          record input to output latency, printed on SIGUSR1 and at exit\n"
+           "  -g, --grab             grab the keyboard so only the cleaned events reach applications\n"
+           "  -C, --config FILE      key pairs to clean (default " DEFAULT_CONFIG " if it exists, else WASD)\n"
+           "  -d, --device PATH      keyboard to read, a path or a /dev/input/by-id name, can be given several times\n"
+           "  -a, --all              read every keyboard found\n"
+           "  -u, --id VID:PID       read the devices with this vendor and product id (hex)\n"
+           "  -p, --phys PATTERN     read the devices whose physical path matches PATTERN\n"
+           "  -N, --no-cache         ask again instead of using the devices picked last time\n"
+           "  -r, --rt-prio PRIO     run the event loop with SCHED_FIFO priority PRIO (1-99)\n"
+           "  -P, --cpu CPU          pin the event loop to CPU\n"
+           "  -m, --mlock            lock all memory so the event loop never page-faults\n"
+           "  -w, --record FILE      record input and output events to a trace FILE (see socd-bench)\n"
+           "  -t, --tick-rate HZ     write the resolved keys once per tick at HZ instead of after every input\n"
+           "  -T, --neutral-ticks N  neutral window in tick mode, in ticks (default 1)\n"
+           "  -A, --app NAME         only clean while this application has the focus, can be given several times\n"
+           "  -x, --split            read and write on separate threads joined by a lock-free queue\n"
+           "  -E, --emit-cpu CPU     pin the writing thread of --split to CPU (default: the one of --cpu)\n"
+           "  -R, --kernel-repeat    let the kernel repeat held keys on the virtual device instead of passing repeats on\n"
+           "  -J, --gamepad          write the axes of analog sources (abs lines) as a virtual gamepad\n"
+           "  -F, --frametime PATH   neutral window of about one frame, from frame times in ms read line by line from PATH\n"
+           "  -S, --stats PATH       export the counters in shared memory at PATH (e.g. /dev/shm/socd)\n"
+           "  -o, --control PATH     serve reload, enable, disable and stats commands on a unix socket at PATH\n"
+           "  -h, --help             show this help\n", name);
+}
 
-int main() {
-    if (signal(SIGINT, sigint_handler) == SIG_ERR) {
-        perror("Failed to set signal handler");
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:f:sc:i:blgC:d:au:p:Nr:P:mw:t:T:xE:A:o:RJS:F:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': {
+            double ms = strtod(optarg, NULL);
+            engine.neutral_ns = ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+            break;
+        }
+        case 'f': {
+            double fps = strtod(optarg, NULL);
+            if (fps <= 0) {
+                fprintf(stderr, "Invalid frame rate: %s\n", optarg);
+                exit(1);
+            }
+            engine.neutral_ns = (uint64_t)(1e9 / fps);
+            break;
+        }
+        case 's':
+            context.sqpoll = 1;
+            break;
+        case 'c':
+            context.sq_cpu = atoi(optarg);
+            break;
+        case 'i':
+            context.sq_idle_ms = (unsigned int)atoi(optarg);
+            break;
+        case 'b':
+            context.busy_poll = 1;
+            break;
+        case 'l':
+            context.latency = 1;
+            break;
+        case 'g':
+            context.grab = engine.passthrough = 1;
+            break;
+        case 'C':
+            context.config_path = optarg;
+            break;
+        case 'd':
+            if (strchr(optarg, '/')) {
+                add_device(optarg);
+            } else {
+                char path[275];
+                snprintf(path, sizeof(path), "%s%s", BY_ID, optarg);
+                add_device(path);
+            }
+            break;
+        case 'a':
+            context.all_devices = 1;
+            break;
+        case 'u':
+            if (sscanf(optarg, "%x:%x", &context.match_vendor, &context.match_product) != 2) {
+                fprintf(stderr, "Invalid device id: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            context.match_phys = optarg;
+            break;
+        case 'N':
+            context.no_cache = 1;
+            break;
+        case 'r':
+            context.rt_prio = atoi(optarg);
+            break;
+        case 'P':
+            context.cpu = atoi(optarg);
+            break;
+        case 'm':
+            context.mlock = 1;
+            break;
+        case 'w':
+            context.record_path = optarg;
+            break;
+        case 't':
+            context.tick_hz = strtod(optarg, NULL);
+            if (context.tick_hz <= 0) {
+                fprintf(stderr, "Invalid tick rate: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'T':
+            context.neutral_ticks = atoi(optarg);
+            if (context.neutral_ticks < 0) {
+                fprintf(stderr, "Invalid neutral ticks: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'x':
+            context.split = 1;
+            break;
+        case 'A':
+            if (context.cli_app_count == MAX_APPS) {
+                fprintf(stderr, "More than %d apps\n", MAX_APPS);
+                exit(1);
+            }
+            context.cli_apps[context.cli_app_count++] = optarg;
+            break;
+        case 'o':
+            context.control_path = optarg;
+            break;
+        case 'S':
+            context.stats_path = optarg;
+            break;
+        case 'F':
+            context.frametime_path = optarg;
+            break;
+        case 'R':
+            context.kernel_repeat = 1;
+            break;
+        case 'J':
+            engine.gamepad = 1;
+            break;
+        case 'E':
+            context.emit_cpu = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (context.split && context.busy_poll && (context.emit_cpu < 0 || context.emit_cpu == context.cpu)) {
+        // Both threads would spin, on one core (and with --rt-prio at one priority) one starves the other
+        fprintf(stderr, "--busy-poll with --split needs --emit-cpu on a core of its own\n");
         exit(1);
     }
+    if (context.config_path) load_config(context.config_path);
+    else if (access(DEFAULT_CONFIG, R_OK) == 0) load_config(DEFAULT_CONFIG);
+    context.config = engine.config;
+    add_cli_apps(context.config);
+    engine.sink = &uinput_sink;
+    if (context.tick_hz) {
+        context.tick_ns = (uint64_t)(1e9 / context.tick_hz);
+        engine.neutral_ns = context.neutral_ticks * context.tick_ns;
+        engine.sink = &tick_sink;
+    } else if (context.split) {
+        engine.sink = &emitter_sink;
+    }
 
     if (geteuid() != 0) {
         fprintf(stderr, "This program requires sudo to access keyboard inputs\n");
         exit(1);
     }
 
-    if (get_keyboard(BY_ID) && get_keyboard(BY_PATH)) {
-        fprintf(stderr, "Failed to get keyboards\n");
-        exit(1);
+    if (context.match_vendor >= 0 || context.match_phys) {
+        match_devices(BY_ID);
+        match_devices(BY_PATH);
+        if (context.device_count == 0) {
+            fprintf(stderr, "No device matches the given id or physical path\n");
+            exit(1);
+        }
+    }
+    // --all scans every time, keyboards plugged in since the last run count as well
+    if (context.device_count == 0 && (context.no_cache || context.all_devices || load_device_cache())) {
+        if (get_keyboard(BY_ID) && get_keyboard(BY_PATH)) {
+            fprintf(stderr, "Failed to get keyboards\n");
+            exit(1);
+        }
+        if (!context.no_cache && !context.all_devices) save_device_cache();
     }
 
-    setup_write();
-
-    context.read_fd = open(context.rd_target, O_RDONLY | O_NONBLOCK);
-    result(context.read_fd);
+    if (context.stats_path) setup_stats();
+    set_neutral(engine.neutral_ns); // Into the counters, the exported ones as well
+    for (int d = 0; d < context.device_count; ++d) result_msg(open_device(&context.devices[d]), context.devices[d].path);
 
-    struct termios t_attrs;
-    tcgetattr(STDIN_FILENO, &t_attrs);
-    t_attrs.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &t_attrs);
+    setup_write();
+    if (engine.gamepad) setup_gamepad();
+    if (context.grab) {
+        for (int d = 0; d < context.device_count; ++d) grab_keyboard(context.devices[d].fd);
+    }
 
-    result(io_uring_queue_init(256, &ring, 0));
+    // Keep typed keys from echoing into the terminal, there is none when running as a service
+    struct termios t_attrs, saved_attrs;
+    int tty = tcgetattr(STDIN_FILENO, &saved_attrs) == 0;
+    if (tty) {
+        t_attrs = saved_attrs;
+        t_attrs.c_lflag &= ~(ECHO | ICANON);
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &t_attrs);
+    }
 
-    while (running_flag) {
-        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-        if (!sqe) continue;
+    struct io_uring_params params = { 0 };
+    if (context.sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = context.sq_idle_ms;
+        if (context.sq_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = (unsigned int)context.sq_cpu;
+        }
+    }
+    result(io_uring_queue_init_params(256, &ring, &params));
 
-        struct input_event ev[64];
-        io_uring_prep_read(sqe, context.read_fd, ev, sizeof(ev), 0);
-        io_uring_sqe_set_data(sqe, ev);
+    setup_signals();
+    setup_files();
+    setup_buffers();
+    setup_reads();
+    setup_hotplug();
+    if (context.tick_hz) setup_tick();
+    if (context.config->app_count) setup_focus();
+    if (context.frametime_path) setup_frametime();
+    if (context.control_path) setup_control();
+    if (context.record_path) record_start(context.record_path);
+    setup_realtime();
+    if (context.split) start_emitter();
 
-        if (io_uring_submit(&ring) < 0) continue;
+    while (context.running) {
+        arm_signals();
+        arm_reads();
+        arm_hotplug();
+        arm_tick();
+        arm_focus();
+        arm_frametime();
+        arm_control();
 
-        struct io_uring_cqe *cqe;
-        if (io_uring_wait_cqe(&ring, &cqe) < 0) continue;
+        int ret = context.busy_poll ? io_uring_submit(&ring) : io_uring_submit_and_wait(&ring, 1);
+        if (ret == -EINTR) continue;
+        if (ret < 0) {
+            submit_failed(-ret);
+        } else {
+            context.submit_retry.failures = 0;
+            // Spin on the CQ ring in userspace, with SQPOLL this loop makes no syscalls at all
+            if (context.busy_poll) while (!io_uring_cq_ready(&ring)) cpu_relax();
+        }
 
-        if (cqe->res < 0) {
-            // Handle read error
-            fprintf(stderr, "Read error: %s\n", strerror(-cqe->res));
-            io_uring_cqe_seen(&ring, cqe);
-            continue;
+        // Reap everything that completed, then resolve and write once for the whole batch
+        struct io_uring_cqe *cqes[CQE_BATCH];
+        unsigned int count = io_uring_peek_batch_cqe(&ring, cqes, CQE_BATCH);
+        STAT_ADD(engine.stats->cqe_batch[BATCH_BUCKET(count)], 1);
+        size_t queued = context.pipe.next;
+        for (unsigned int i = 0; i < count; ++i) {
+            switch (TAG_OP(io_uring_cqe_get_data64(cqes[i]))) {
+            case OP_READ:
+                handle_read(cqes[i]);
+                break;
+            case OP_HOTPLUG:
+                handle_hotplug(cqes[i]);
+                break;
+            case OP_TICK:
+                handle_tick(cqes[i]);
+                break;
+            case OP_FOCUS:
+                handle_focus(cqes[i]);
+                break;
+            case OP_FRAMETIME:
+                handle_frametime(cqes[i]);
+                break;
+            case OP_ACCEPT: case OP_COMMAND: case OP_REPLY:
+                handle_control(cqes[i]);
+                break;
+            case OP_SIGNAL:
+                handle_signal(cqes[i]);
+                break;
+            case OP_WRITE:
+                handle_write(cqes[i]);
+                break;
+            default:
+                // Timeout completions (-ETIME) only need the emit_all() below
+                break;
+            }
         }
+        io_uring_cq_advance(&ring, count);
 
-        unsigned int num_events = (unsigned int)(cqe->res / sizeof(struct input_event));
-        for (unsigned int i = 0; i < num_events; ++i) {
-            process_event(&((struct input_event *)cqe->user_data)[i]);
+        if (context.split) {
+            // Hand the batch to the emitter, it resolves and writes while the next reads complete
+            if (context.ticked) {
+                pipe_push(&context.pipe, (struct transition){ .value = (int32_t)context.pending_ticks, .kind = TR_TICK });
+                context.pending_ticks = 0;
+                context.ticked = 0;
+            }
+            // A batch of dropped repeats or other completions leaves the emitter asleep
+            if (context.pipe.next != queued) pipe_push(&context.pipe, (struct transition){ .time = now_ns(), .kind = TR_SYNC });
+            pipe_publish(&context.pipe);
+        } else if (!context.tick_hz || context.ticked) {
+            // In tick mode the state is only written on a tick, everything read in between is coalesced
+            context.ticked = 0;
+            emit_all();
+            if (context.latency) record_latency();
         }
+    }
 
-        io_uring_cqe_seen(&ring, cqe);
-        
-        emit_all();
+    if (context.split) {
+        pipe_push(&context.pipe, (struct transition){ .kind = TR_STOP });
+        pipe_publish(&context.pipe);
+        pthread_join(context.emitter, NULL);
     }
+    // Nothing may stay pressed once the virtual device is gone, applications would never see the release.
+    // The frames still queued go first, so the release can't be overtaken by one of them.
+    drain_writes();
+    context.ring_writes = 0;
+    release_all();
+    if (context.latency) dump_latency();
+    record_stop();
 
     result(ioctl(context.write_fd, UI_DEV_DESTROY));
     close(context.write_fd);
-    close(context.read_fd);
+    if (context.gamepad_fd >= 0) {
+        ioctl(context.gamepad_fd, UI_DEV_DESTROY);
+        close(context.gamepad_fd);
+    }
+    for (int d = 0; d < context.device_count; ++d) {
+        if (context.devices[d].fd < 0) continue;
+        if (context.grab) ioctl(context.devices[d].fd, EVIOCGRAB, 0);
+        close(context.devices[d].fd);
+    }
+    if (context.inotify_fd >= 0) close(context.inotify_fd);
+    if (context.tick_fd >= 0) close(context.tick_fd);
+    if (context.focus_fd >= 0) close(context.focus_fd);
+    if (context.frametime_fd >= 0) close(context.frametime_fd);
+    if (context.signal_fd >= 0) close(context.signal_fd);
+    close_control();
+    close_stats();
+    if (context.buf_ring) io_uring_free_buf_ring(&ring, context.buf_ring, READ_BUFS, READ_BGID);
     io_uring_queue_exit(&ring);
 
     // Restore terminal settings
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &t_attrs);
+    if (tty) tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_attrs);
+}
+
+// Signals arrive as completions like everything else, so they wake the loop wherever it waits and are
+// handled between two batches. Blocked before any thread starts so they all inherit the mask.
+void setup_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    result_msg(sigprocmask(SIG_BLOCK, &set, NULL), "Failed to block signals");
+    context.signal_fd = signalfd(-1, &set, SFD_CLOEXEC);
+    result_msg(context.signal_fd, "Failed to create the signalfd");
 }
 
-void sigint_handler(int sig) {
-    (void)sig;
-    running_flag = 0;
+void arm_signals() {
+    if (context.signal_armed) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_read(sqe, context.signal_fd, &context.siginfo, sizeof(context.siginfo), 0);
+    io_uring_sqe_set_data64(sqe, TAG(OP_SIGNAL, 0, 0));
+    context.signal_armed = 1;
+}
+
+void handle_signal(const struct io_uring_cqe *cqe) {
+    context.signal_armed = 0;
+    if (cqe->res != sizeof(context.siginfo)) return;
+    if (context.siginfo.ssi_signo == SIGUSR1) dump_latency();
+    else context.running = 0; // The batch is finished first, then the loop ends
+}
+
+static inline unsigned int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB) return (unsigned int)value;
+    int msb = 63 - __builtin_clzll(value);
+    return (unsigned int)((msb - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+// Largest value that falls into a bucket
+static inline uint64_t hist_bucket_max(unsigned int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+// Upper bound of the bucket holding the p-th fraction of the samples
+uint64_t hist_percentile(const struct histogram *h, double p) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    uint64_t target = (uint64_t)(p * count + 0.5), seen = 0;
+    if (target == 0) target = 1;
+    for (unsigned int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t value = hist_bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+// One line summary of a histogram, returns the length like snprintf()
+int hist_format(const struct histogram *h, const char *name, char *out, size_t size) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (count == 0) return snprintf(out, size, "%s: no samples\n", name);
+    return snprintf(out, size, "%s (%llu samples): p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", name,
+                    (unsigned long long)count, hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+                    hist_percentile(h, 0.999) / 1e3, atomic_load_explicit(&h->max, memory_order_relaxed) / 1e3);
+}
+
+void hist_dump(const struct histogram *h, const char *name) {
+    char line[256];
+    hist_format(h, name, line, sizeof(line));
+    fputs(line, stderr);
+}
+
+static void record_samples(const uint64_t *times, int count) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < count; ++i) hist_record(&context.lat_hist, now > times[i] ? now - times[i] : 0);
+}
+
+// Record the latency of every key event of the batch that was just resolved and written. A frame queued
+// on the ring is only written once its write completes, handle_write() records the batch then.
+void record_latency() {
+    int write = context.last_write;
+    context.last_write = -1;
+    if (context.lat_count == 0) return;
+    if (write < 0) {
+        record_samples(context.lat_pending, context.lat_count);
+    } else {
+        // Under SQPOLL the write of the last batch can still be waiting, both are recorded with this one
+        int room = (int)(sizeof(context.lat_writing) / sizeof(context.lat_writing[0])) - context.lat_writing_count;
+        int count = context.lat_count < room ? context.lat_count : room;
+        memcpy(context.lat_writing + context.lat_writing_count, context.lat_pending, count * sizeof(uint64_t));
+        context.lat_writing_count += count;
+        context.lat_write = write;
+    }
+    context.lat_count = 0;
+}
+
+void dump_latency() {
+    if (context.split) hist_dump(&context.queue_hist, "input to emitter latency");
+    hist_dump(&context.lat_hist, "input to uinput latency");
+}
+
+// Emitter sink: engine.state keeps every deadline, emitter_main() waits for the earliest one
+void emitter_timer(uint64_t deadline) {
+    if (!context.emit_deadline || deadline < context.emit_deadline) context.emit_deadline = deadline;
+}
+
+// Earliest neutral deadline still pending after a resolve
+static uint64_t next_deadline(void) {
+    uint64_t next = 0;
+    for (uint64_t n = engine.neutral & AXIS_LO; n; n &= n - 1) {
+        uint64_t until = engine.state[__builtin_ctzll(n) / 2].neutral_until;
+        if (!next || until < next) next = until;
+    }
+    return next;
+}
+
+void start_emitter() {
+    if (pthread_create(&context.emitter, NULL, emitter_main, NULL)) {
+        fprintf(stderr, "Failed to start the emitter thread\n");
+        exit(1);
+    }
+}
+
+// Emitter thread of --split. It owns the engine: the io_uring loop only queues key transitions, so a
+// slow uinput write never delays the next read. The recording and the latency samples of the input
+// are taken here as well, which keeps every ring single producer.
+void *emitter_main(void *arg) {
+    (void)arg;
+    // Inherits the policy and affinity of the loop, which set them up before starting us
+    if (context.emit_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(context.emit_cpu, &set);
+        result_msg(sched_setaffinity(0, sizeof(set), &set), "Failed to pin the emitter");
+    }
+
+    struct pipe *p = &context.pipe;
+    size_t tail = 0;
+    for (;;) {
+        size_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (head == tail) {
+            // Nothing queued, wait for the reader or the next neutral deadline
+            uint64_t now = context.emit_deadline ? now_ns() : 0;
+            if (context.emit_deadline && now >= context.emit_deadline) {
+                emit_all();
+                context.emit_deadline = next_deadline();
+                continue;
+            }
+            if (context.busy_poll) {
+                cpu_relax();
+                continue;
+            }
+            struct timespec timeout, *wait = NULL;
+            if (context.emit_deadline) {
+                uint64_t left = context.emit_deadline - now;
+                timeout = (struct timespec){ left / 1000000000, left % 1000000000 };
+                wait = &timeout;
+            }
+            pipe_wait(p, tail, wait);
+            continue;
+        }
+
+        uint64_t popped = context.latency ? now_ns() : 0;
+        char resolve = 0, stop = 0;
+        for (; tail != head; ++tail) {
+            const struct transition *tr = &p->ring[tail & (PIPE_SIZE - 1)];
+            switch (tr->kind) {
+            case TR_KEY: case TR_ABS: {
+                struct input_event ev = {
+                    .input_event_sec = tr->time / 1000000000, .input_event_usec = tr->time % 1000000000 / 1000,
+                    .type = tr->kind == TR_KEY ? EV_KEY : EV_ABS, .code = tr->code, .value = tr->value
+                };
+                if (recorder.enabled) record_event(tr->dev, tr->time, &ev);
+                if (context.latency) {
+                    hist_record(&context.queue_hist, popped > tr->time ? popped - tr->time : 0);
+                    if (context.lat_count < CQE_BATCH * READ_EVENTS) context.lat_pending[context.lat_count++] = tr->time;
+                }
+                process_event(tr->dev, &ev);
+                break;
+            }
+            case TR_SYNC:
+                if (recorder.enabled) record_event(0, tr->time, &(struct input_event){ .type = EV_SYN, .code = SYN_REPORT });
+                resolve |= !context.tick_hz;
+                break;
+            case TR_TICK:
+                engine.frame_counter += (uint64_t)tr->value;
+                resolve = 1;
+                break;
+            case TR_BYPASS:
+                set_bypass((char)tr->value);
+                break;
+            case TR_NEUTRAL:
+                set_neutral(tr->time);
+                break;
+            case TR_CONFIG:
+                use_config(spare_config());
+                atomic_store_explicit(&context.config_pending, 0, memory_order_release);
+                break;
+            case TR_RELEASE:
+                release_device(tr->dev);
+                break;
+            case TR_STOP:
+                stop = 1;
+                break;
+            }
+        }
+        atomic_store_explicit(&p->tail, tail, memory_order_release);
+
+        // Everything queued while the last write was in progress goes out in one write
+        if (resolve) {
+            emit_all();
+            if (!context.tick_hz) context.emit_deadline = next_deadline();
+            if (context.latency) record_latency();
+        }
+        if (stop) return NULL;
+    }
 }
 
 void setup_write() {
@@ -138,8 +936,27 @@ void setup_write() {
     result(context.write_fd);
 
     result(ioctl(context.write_fd, UI_SET_EVBIT, EV_KEY));
-    for (int i = 0; i < KEY_COUNT; i++) {
-        result(ioctl(context.write_fd, UI_SET_KEYBIT, context.vr_keystates[i].which));
+    if (context.kernel_repeat) result(ioctl(context.write_fd, UI_SET_EVBIT, EV_REP));
+    unsigned char *key_bits = context.key_bits;
+    for (int a = 0; a < context.config->axis_count; a++) {
+        for (int side = 0; side < 2; side++) {
+            int code = context.config->axes[a].keys[side];
+            key_bits[code / 8] |= 1 << (code % 8);
+        }
+    }
+    // The device can't change once created, so a config reloaded later can bind any keyboard key
+    if (context.control_path) memset(key_bits, 0xFF, BTN_MISC / 8);
+
+    if (context.grab) {
+        // Every key of the grabbed keyboards is forwarded, so the virtual device needs all of them
+        for (int d = 0; d < context.device_count; ++d) {
+            unsigned char bits[KEY_MAX / 8 + 1] = { 0 };
+            result_msg(ioctl(context.devices[d].fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits), "Failed to query keyboard keys");
+            for (size_t i = 0; i < sizeof(bits); i++) key_bits[i] |= bits[i];
+        }
+    }
+    for (int code = 1; code <= KEY_MAX; code++) {
+        if (key_bits[code / 8] & (1 << (code % 8))) result(ioctl(context.write_fd, UI_SET_KEYBIT, code));
     }
 
     struct uinput_setup setup = { .name = "socd_cleaner", .id = { .bustype = BUS_USB, .vendor = 0x1234, .product = 0x5678 } };
@@ -147,118 +964,1323 @@ void setup_write() {
     result(ioctl(context.write_fd, UI_DEV_CREATE));
 }
 
-void process_event(const struct input_event *ev) {
-    if (ev->value == 1) { // Key down
-        for (int i = 0; i < KEY_COUNT; ++i) {
-            if (ev->code == context.vr_keystates[i].which) {
-                atomic_store(&context.rl_keystates[i], 1);
-                atomic_store(&context.last_pressed, i); // Store the index of the last pressed key
+// Second virtual device for --gamepad, so it is seen as a gamepad and not as a keyboard with axes. It has
+// the axes of the configured analog sources and the sticks and hat, which a reload can move to.
+void setup_gamepad() {
+    context.gamepad_fd = open(context.wr_target, O_WRONLY | O_NONBLOCK);
+    result(context.gamepad_fd);
+
+    context.abs_bits = 1ull << ABS_X | 1ull << ABS_Y | 1ull << ABS_RX | 1ull << ABS_RY | 1ull << ABS_HAT0X | 1ull << ABS_HAT0Y;
+    for (int i = 0; i < context.config->abs_count; ++i) context.abs_bits |= 1ull << context.config->abs[i].code;
+    result(ioctl(context.gamepad_fd, UI_SET_EVBIT, EV_ABS));
+    for (int code = 0; code < ABS_CNT; ++code) {
+        if (!(context.abs_bits >> code & 1)) continue;
+        struct uinput_abs_setup abs = { .code = code, .absinfo = { .minimum = -GAMEPAD_RANGE, .maximum = GAMEPAD_RANGE } };
+        result(ioctl(context.gamepad_fd, UI_ABS_SETUP, &abs));
+    }
+    // Never pressed, they only make the device look like a gamepad to udev and SDL
+    result(ioctl(context.gamepad_fd, UI_SET_EVBIT, EV_KEY));
+    result(ioctl(context.gamepad_fd, UI_SET_KEYBIT, BTN_SOUTH));
+    result(ioctl(context.gamepad_fd, UI_SET_KEYBIT, BTN_EAST));
+
+    struct uinput_setup setup = { .name = "socd_gamepad", .id = { .bustype = BUS_USB, .vendor = 0x1234, .product = 0x5679 } };
+    result(ioctl(context.gamepad_fd, UI_DEV_SETUP, &setup));
+    result(ioctl(context.gamepad_fd, UI_DEV_CREATE));
+}
+
+// Prefer one multishot read per device fed from a shared provided buffer ring, otherwise keep
+// READ_DEPTH fixed reads into registered buffers queued per device at all times
+void setup_reads() {
+#if IO_URING_VERSION_MAJOR > 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR >= 5)
+    struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    if (probe && io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT)) {
+        int ret;
+        context.buf_ring = io_uring_setup_buf_ring(&ring, READ_BUFS, READ_BGID, 0, &ret);
+        if (context.buf_ring) {
+            for (int i = 0; i < READ_BUFS; ++i) {
+                io_uring_buf_ring_add(context.buf_ring, context.read_bufs[i], sizeof(context.read_bufs[i]), i,
+                                      io_uring_buf_ring_mask(READ_BUFS), i);
+            }
+            io_uring_buf_ring_advance(context.buf_ring, READ_BUFS);
+            context.multishot = 1;
+        }
+    }
+    if (probe) io_uring_free_probe(probe);
+    if (context.multishot) {
+        // Fixed reads stay idle, this keeps the in flight check in check_device() the same for both modes
+        for (int d = 0; d < MAX_DEVICES; ++d) context.devices[d].idle_reads = ALL_READS;
+        return;
+    }
+#endif
+    setup_fixed_reads();
+}
+
+void setup_fixed_reads() {
+    if (!context.buffers_registered) {
+        fprintf(stderr, "Failed to register the read buffers\n");
+        exit(1);
+    }
+    for (int d = 0; d < MAX_DEVICES; ++d) context.devices[d].idle_reads = ALL_READS;
+}
+
+// Register the devices and the virtual device, the kernel then skips the fd lookup on every read and
+// write. Slots of unplugged devices stay empty (-1) until update_file() fills them.
+void setup_files() {
+    int fds[FILE_SLOTS];
+    for (int d = 0; d < MAX_DEVICES; ++d) fds[d] = d < context.device_count ? context.devices[d].fd : -1;
+    fds[WRITE_FILE] = context.write_fd;
+    fds[GAMEPAD_FILE] = context.gamepad_fd;
+    context.fixed_files = io_uring_register_files(&ring, fds, FILE_SLOTS) == 0;
+}
+
+void update_file(int slot, int fd) {
+    if (context.fixed_files && io_uring_register_files_update(&ring, (unsigned int)slot, &fd, 1) < 0) {
+        // Keeps working on plain fds, only the lookup saving is gone
+        perror("Failed to update the registered files");
+        context.fixed_files = 0;
+    }
+}
+
+// Read and write buffers are registered in one table, so fixed reads and writes skip mapping them on
+// every operation. The read buffers are also the provided buffers of multishot reads.
+void setup_buffers() {
+    struct iovec iovecs[READ_BUFS + WRITE_BUFS];
+    for (int i = 0; i < READ_BUFS; ++i) {
+        iovecs[i] = (struct iovec){ .iov_base = context.read_bufs[i], .iov_len = sizeof(context.read_bufs[i]) };
+    }
+    for (int i = 0; i < WRITE_BUFS; ++i) {
+        iovecs[READ_BUFS + i] = (struct iovec){ .iov_base = context.write_bufs[i], .iov_len = sizeof(context.write_bufs[i]) };
+    }
+    context.buffers_registered = io_uring_register_buffers(&ring, iovecs, READ_BUFS + WRITE_BUFS) == 0;
+    context.idle_writes = (uint32_t)((1ull << WRITE_BUFS) - 1);
+    // The emitter thread of --split can't use the ring, it writes by itself
+    context.ring_writes = context.buffers_registered && !context.split;
+}
+
+// What an SQE addresses a file by: its registered slot, or the fd when files aren't registered
+static inline int ring_file(int slot, int fd) {
+    return context.fixed_files ? slot : fd;
+}
+
+// Queue every read buffer that is not in flight, for every device
+void arm_reads() {
+    for (int d = 0; d < context.device_count; ++d) {
+        struct device *dev = &context.devices[d];
+        if (!retry_due(&dev->retry)) continue;
+        if (dev->fd < 0 && dev->reopen && !dev->lost) {
+            dev->reopen = 0;
+            device_found(d);
+        }
+        if (dev->fd < 0 || dev->lost) continue;
+#if IO_URING_VERSION_MAJOR > 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR >= 5)
+        if (context.multishot) {
+            if (dev->multishot_armed) continue;
+            struct io_uring_sqe *sqe = get_sqe();
+            if (!sqe) return;
+            io_uring_prep_read_multishot(sqe, ring_file(d, dev->fd), 0, 0, READ_BGID);
+            if (context.fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data64(sqe, TAG(OP_READ, d, MULTISHOT_IDX));
+            dev->multishot_armed = 1;
+            continue;
+        }
+#endif
+        while (dev->idle_reads) {
+            int i = __builtin_ctz(dev->idle_reads), buf = d * READ_DEPTH + i;
+            struct io_uring_sqe *sqe = get_sqe();
+            if (!sqe) return;
+            io_uring_prep_read_fixed(sqe, ring_file(d, dev->fd), context.read_bufs[buf], sizeof(context.read_bufs[buf]), 0, buf);
+            if (context.fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data64(sqe, TAG(OP_READ, d, buf));
+            dev->idle_reads &= ~(1u << i);
+        }
+    }
+}
+
+void handle_read(const struct io_uring_cqe *cqe) {
+    uint64_t tag = io_uring_cqe_get_data64(cqe);
+    int d = TAG_DEV(tag), idx = TAG_IDX(tag);
+    struct device *dev = &context.devices[d];
+
+    if (idx == MULTISHOT_IDX) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) dev->multishot_armed = 0;
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            // -ENOBUFS or another error without data, the read is re-armed by arm_reads()
+            if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                if (!context.multishot_ok && classify_error(-cqe->res) == ERR_FATAL) {
+                    // Multishot reads are not supported for these files (-EINVAL, -EBADFD), fall back to fixed reads
+                    if (context.multishot) {
+                        context.multishot = 0;
+                        setup_fixed_reads();
+                    }
+                } else {
+                    device_error(d, -cqe->res);
+                }
             }
+            check_device(d);
+            return;
         }
-    } else if (ev->value == 0) { // Key up
-        for (int i = 0; i < KEY_COUNT; ++i) {
-            if (ev->code == context.vr_keystates[i].which) {
-                atomic_store(&context.rl_keystates[i], 0);
+        idx = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        context.multishot_ok = 1;
+    } else {
+        dev->idle_reads |= 1u << (idx - d * READ_DEPTH);
+    }
+
+    if (cqe->res < 0) {
+        device_error(d, -cqe->res);
+    } else {
+        dev->retry.failures = 0;
+        unsigned int num_events = (unsigned int)(cqe->res / sizeof(struct input_event));
+        STAT_ADD(engine.stats->read_batch[BATCH_BUCKET(num_events)], 1);
+        // evdev only hands out whole events, a remainder can't be completed by the next read
+        if (cqe->res % sizeof(struct input_event)) {
+            STAT_ADD(engine.stats->short_reads, 1);
+            if (!context.stats_path) {
+                log_limited(&dev->retry, "Short read on %s, dropped %d bytes\n", dev->path, (int)(cqe->res % sizeof(struct input_event)));
+            }
+        }
+        for (unsigned int i = 0; i < num_events; ++i) {
+            const struct input_event *ev = &context.read_bufs[idx][i];
+            // The virtual device generates its own repeats, these would only double them
+            if (context.kernel_repeat && ev->type == EV_KEY && ev->value == 2) continue;
+            if (context.split) {
+                if (ev->type != EV_KEY && ev->type != EV_ABS) continue;
+                pipe_push(&context.pipe, (struct transition){
+                    .time = (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000,
+                    .value = ev->value, .code = ev->code, .dev = d, .kind = ev->type == EV_KEY ? TR_KEY : TR_ABS
+                });
+                continue;
+            }
+            if (context.latency && ev->type == EV_KEY && context.lat_count < CQE_BATCH * READ_EVENTS) {
+                context.lat_pending[context.lat_count++] = (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000;
+            }
+            if (recorder.enabled) record_event(d, (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000, ev);
+            process_event(d, ev);
+        }
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        // Hand the buffer back to the kernel
+        io_uring_buf_ring_add(context.buf_ring, context.read_bufs[idx], sizeof(context.read_bufs[idx]), idx,
+                              io_uring_buf_ring_mask(READ_BUFS), 0);
+        io_uring_buf_ring_advance(context.buf_ring, 1);
+    }
+    check_device(d);
+}
+
+// Take the keyboard for ourselves. Waits a moment for held keys (e.g. the enter that started us)
+// to be released first, otherwise their release would never reach the focused application.
+void grab_keyboard(int fd) {
+    unsigned char key_state[KEY_MAX / 8 + 1];
+    for (int tries = 0; tries < 100; ++tries) {
+        memset(key_state, 0, sizeof(key_state));
+        if (ioctl(fd, EVIOCGKEY(sizeof(key_state)), key_state) < 0) break;
+        int held = 0;
+        for (size_t i = 0; i < sizeof(key_state); ++i) held |= key_state[i];
+        if (!held) break;
+        struct timespec wait = {0, 10000000}; // 10 ms
+        nanosleep(&wait, NULL);
+    }
+    result_msg(ioctl(fd, EVIOCGRAB, 1), "Failed to grab keyboard");
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// One frame to a virtual device, queued on the ring when it can be
+static void write_frame(int slot, int fd, const struct input_event *events, size_t count) {
+    struct io_uring_sqe *sqe = NULL;
+    if (context.ring_writes && context.idle_writes) sqe = get_sqe();
+    if (sqe) {
+        // Queued into a registered buffer, it goes out with the submission at the top of the loop
+        int i = __builtin_ctz(context.idle_writes);
+        memcpy(context.write_bufs[i], events, count * sizeof(struct input_event));
+        io_uring_prep_write_fixed(sqe, ring_file(slot, fd), context.write_bufs[i],
+                                  (unsigned int)(count * sizeof(struct input_event)), 0, READ_BUFS + i);
+        if (context.fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+        io_uring_sqe_set_data64(sqe, TAG(OP_WRITE, 0, i));
+        context.idle_writes &= ~(1u << i);
+        context.last_write = i;
+    } else {
+        if (context.ring_writes) {
+            // Every buffer is in flight. uinput writes complete as they are issued, so once the queued
+            // ones are submitted and taken by the kernel this one can't overtake them. A ring that can't
+            // submit (or an SQPOLL thread that doesn't take them) is only waited for so long.
+            int ret = io_uring_submit(&ring);
+            if (ret < 0) {
+                STAT_ADD(engine.stats->submit_errors, 1);
+            } else {
+                uint64_t deadline = now_ns() + WRITE_DRAIN_NS;
+                while (io_uring_sq_ready(&ring) && now_ns() < deadline) cpu_relax();
             }
         }
+        result(write(fd, events, count * sizeof(struct input_event)));
+    }
+}
+
+// Engine sink: one frame, one write to uinput. With --gamepad the gamepad axes of the frame are written
+// to the gamepad device as a frame of their own.
+void uinput_write(const struct input_event *events, size_t count) {
+    if (context.gamepad_fd < 0) {
+        write_frame(WRITE_FILE, context.write_fd, events, count);
+    } else {
+        struct input_event keys[OUT_BUF_SIZE], pad[OUT_BUF_SIZE];
+        size_t key_count = 0, pad_count = 0;
+        for (size_t i = 0; i + 1 < count; ++i) {
+            if (events[i].type == EV_ABS) pad[pad_count++] = events[i];
+            else keys[key_count++] = events[i];
+        }
+        if (key_count) {
+            keys[key_count++] = events[count - 1]; // SYN_REPORT
+            write_frame(WRITE_FILE, context.write_fd, keys, key_count);
+        }
+        if (pad_count) {
+            pad[pad_count++] = events[count - 1];
+            write_frame(GAMEPAD_FILE, context.gamepad_fd, pad, pad_count);
+        }
+    }
+    if (recorder.enabled) {
+        uint64_t now = now_ns();
+        for (size_t i = 0; i < count; ++i) record_event(TRACE_OUTPUT, now, &events[i]);
+    }
+}
+
+// Socket of a running compositor in the runtime directory of the user, sudo usually drops the
+// environment so the one of the user that ran sudo is tried as well. Returns the kind or -1.
+static int find_focus_socket(char *path, size_t size) {
+    char runtime[64];
+    const char *dir = getenv("XDG_RUNTIME_DIR"), *sudo_uid = getenv("SUDO_UID");
+    if (!dir && sudo_uid) {
+        snprintf(runtime, sizeof(runtime), "/run/user/%s", sudo_uid);
+        dir = runtime;
+    }
+    if (!dir) return -1;
+
+    const char *hypr = getenv("HYPRLAND_INSTANCE_SIGNATURE"), *sway = getenv("SWAYSOCK");
+    if (hypr) {
+        snprintf(path, size, "%s/hypr/%s/.socket2.sock", dir, hypr);
+        return FOCUS_HYPRLAND;
+    }
+    if (sway) {
+        snprintf(path, size, "%s", sway);
+        return FOCUS_SWAY;
+    }
+
+    static const struct { const char *pattern; int kind; } sockets[] = {
+        { "%s/hypr/*/.socket2.sock", FOCUS_HYPRLAND },
+        { "%s/sway-ipc.*.sock", FOCUS_SWAY },
+    };
+    int kind = -1;
+    for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]) && kind < 0; ++i) {
+        char pattern[128];
+        glob_t found;
+        snprintf(pattern, sizeof(pattern), sockets[i].pattern, dir);
+        if (glob(pattern, 0, NULL, &found) == 0 && found.gl_pathc) {
+            snprintf(path, size, "%s", found.gl_pathv[0]);
+            kind = sockets[i].kind;
+        }
+        globfree(&found);
     }
+    return kind;
 }
 
-void emit(int type, int code, int value) {
-    struct input_event event = { .code = code, .type = type, .value = value, .time = {0, 0} };
-    result(write(context.write_fd, &event, sizeof(event)));
+// Follow the focused window through the event socket of the compositor (Hyprland or sway). Without
+// one socd keeps cleaning everywhere.
+void setup_focus() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    context.focus_kind = find_focus_socket(addr.sun_path, sizeof(addr.sun_path));
+    if (context.focus_kind < 0) {
+        fprintf(stderr, "No Hyprland or sway session found, cleaning in every application\n");
+        return;
+    }
+
+    context.focus_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (context.focus_fd < 0 || connect(context.focus_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        fprintf(stderr, "Cleaning in every application\n");
+        if (context.focus_fd >= 0) close(context.focus_fd);
+        context.focus_fd = -1;
+        return;
+    }
+    if (context.focus_kind == FOCUS_SWAY) {
+        static const char payload[] = "[\"window\"]";
+        char msg[SWAY_HEADER + sizeof(payload) - 1];
+        uint32_t header[2] = { sizeof(payload) - 1, SWAY_SUBSCRIBE };
+        memcpy(msg, SWAY_IPC_MAGIC, 6);
+        memcpy(msg + 6, header, sizeof(header));
+        memcpy(msg + SWAY_HEADER, payload, sizeof(payload) - 1);
+        result_msg(write(context.focus_fd, msg, sizeof(msg)), "Failed to subscribe to sway window events");
+    }
 }
 
-void emit_all() {
-    int up_pressed = atomic_load(&context.rl_keystates[UP]);
-    int down_pressed = atomic_load(&context.rl_keystates[DOWN]);
-    int left_pressed = atomic_load(&context.rl_keystates[LEFT]);
-    int right_pressed = atomic_load(&context.rl_keystates[RIGHT]);
+void arm_focus() {
+    if (context.focus_fd < 0 || context.focus_armed) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_recv(sqe, context.focus_fd, context.focus_buf + context.focus_len,
+                       sizeof(context.focus_buf) - 1 - context.focus_len, 0); // One byte to terminate a JSON payload
+    io_uring_sqe_set_data64(sqe, TAG(OP_FOCUS, 0, 0));
+    context.focus_armed = 1;
+}
 
-    // Handle SOCD for UP and DOWN keys
-    if (up_pressed && down_pressed) {
-        emit(EV_KEY, context.vr_keystates[UP].which, 0);
-        emit(EV_KEY, context.vr_keystates[DOWN].which, 0);
+// Value of the first "key": "string" in a JSON text, 0 when it is missing or not a string
+static int json_string(const char *json, const char *key, char *out, size_t size) {
+    char quoted[32];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *p = strstr(json, quoted);
+    if (!p) return 0;
+    p += strlen(quoted);
+    while (*p == ' ' || *p == ':') p++;
+    if (*p++ != '"') return 0;
+    size_t n = 0;
+    for (; *p && *p != '"' && n + 1 < size; ++p) {
+        if (*p == '\\' && p[1]) p++;
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+// Consume the complete events in focus_buf, returns the bytes used
+static size_t parse_focus(char *buf, size_t len) {
+    char app[APP_NAME_LEN];
+    size_t used = 0;
+    if (context.focus_kind == FOCUS_HYPRLAND) {
+        // One event per line: activewindow>>class,title
+        char *line = buf, *end;
+        while ((end = memchr(line, '\n', len - used))) {
+            *end = '\0';
+            if (!strncmp(line, "activewindow>>", 14)) {
+                snprintf(app, sizeof(app), "%.*s", (int)strcspn(line + 14, ","), line + 14);
+                focus_changed(app);
+            }
+            used += end + 1 - line;
+            line = end + 1;
+        }
+        return used;
+    }
 
-        int last_pressed_index = atomic_load(&context.last_pressed);
-        // Control logic for 'W' and 'S'
-        if (!(left_pressed || right_pressed)) {
-            // Sleep for ~16.67 ms
-            struct timespec sleep_time = {0, 16700000}; // 16.7 ms
-            nanosleep(&sleep_time, NULL);
+    // sway: i3-ipc frames, window events with "change": "focus" carry the focused container
+    while (len - used >= SWAY_HEADER) {
+        uint32_t header[2];
+        memcpy(header, buf + used + 6, sizeof(header));
+        if (header[0] > sizeof(context.focus_buf) - 1 - SWAY_HEADER) {
+            // Larger than the buffer, drop it as it comes in
+            context.focus_skip = SWAY_HEADER + header[0];
+            return used;
         }
-        emit(EV_KEY, context.vr_keystates[last_pressed_index].which, 1);  // Emit last pressed key
+        if (len - used < SWAY_HEADER + header[0]) break;
+        char *json = buf + used + SWAY_HEADER, saved = json[header[0]];
+        json[header[0]] = '\0';
+        char change[16];
+        if (header[1] == SWAY_EVENT_WINDOW && json_string(json, "change", change, sizeof(change)) && !strcmp(change, "focus")) {
+            // Native Wayland windows have an app id, Xwayland ones only a class
+            if (!json_string(json, "app_id", app, sizeof(app)) && !json_string(json, "class", app, sizeof(app))) app[0] = '\0';
+            focus_changed(app);
+        }
+        json[header[0]] = saved;
+        used += SWAY_HEADER + header[0];
+    }
+    return used;
+}
+
+void handle_focus(const struct io_uring_cqe *cqe) {
+    context.focus_armed = 0;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) return;
+    if (cqe->res <= 0) {
+        // The compositor went away, fall back to cleaning everywhere
+        fprintf(stderr, "Lost the compositor connection: %s, cleaning in every application\n",
+                cqe->res ? strerror(-cqe->res) : "closed");
+        close(context.focus_fd);
+        context.focus_fd = -1;
+        focus_changed(NULL);
+        return;
+    }
+
+    size_t len = context.focus_len + (size_t)cqe->res, used = 0;
+    if (context.focus_skip) {
+        used = len < context.focus_skip ? len : context.focus_skip;
+        context.focus_skip -= used;
+    }
+    used += parse_focus(context.focus_buf + used, len - used);
+    if (used < len && len == sizeof(context.focus_buf) - 1) used = len; // A line that doesn't fit, drop it
+    memmove(context.focus_buf, context.focus_buf + used, len - used);
+    context.focus_len = len - used;
+}
+
+// NULL cleans in every application again
+void focus_changed(const char *app) {
+    context.focused = app != NULL;
+    if (app) snprintf(context.focus_app, sizeof(context.focus_app), "%s", app);
+    update_bypass();
+}
+
+// Keys go through uncleaned while cleaning is disabled or the focused application isn't allowlisted
+void update_bypass() {
+    char bypass = context.disabled || (context.focused && !app_allowed(context.config, context.focus_app));
+    if (context.split) pipe_push(&context.pipe, (struct transition){ .value = bypass, .kind = TR_BYPASS });
+    else set_bypass(bypass);
+}
+
+void add_cli_apps(struct config *config) {
+    for (int i = 0; i < context.cli_app_count; ++i) {
+        if (add_app(config, context.cli_apps[i]) < 0) fprintf(stderr, "More than %d apps, ignoring %s\n", MAX_APPS, context.cli_apps[i]);
+    }
+}
+
+// Frame times of the game, one per line in milliseconds, e.g. from a FIFO fed by the MangoHud log
+// (tail -f log.csv | cut -d, -f2). A FIFO is opened for writing as well, so it never reads end of file
+// while nobody writes to it.
+void setup_frametime() {
+    struct stat st;
+    int fifo = stat(context.frametime_path, &st) == 0 && S_ISFIFO(st.st_mode);
+    context.frametime_fd = open(context.frametime_path, (fifo ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    result_msg(context.frametime_fd, context.frametime_path);
+}
+
+void arm_frametime() {
+    if (context.frametime_fd < 0 || context.frametime_armed) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_read(sqe, context.frametime_fd, context.frametime_buf + context.frametime_len,
+                       sizeof(context.frametime_buf) - 1 - context.frametime_len, -1);
+    io_uring_sqe_set_data64(sqe, TAG(OP_FRAMETIME, 0, 0));
+    context.frametime_armed = 1;
+}
+
+void handle_frametime(const struct io_uring_cqe *cqe) {
+    context.frametime_armed = 0;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) return;
+    if (cqe->res <= 0) {
+        // End of a file, or the feed broke: the window stays at the last estimate
+        if (cqe->res) fprintf(stderr, "Frame time feed failed: %s\n", strerror(-cqe->res));
+        close(context.frametime_fd);
+        context.frametime_fd = -1;
+        return;
+    }
+
+    size_t len = context.frametime_len + (size_t)cqe->res, used = 0;
+    char *end;
+    while ((end = memchr(context.frametime_buf + used, '\n', len - used))) {
+        *end = '\0';
+        char *number = context.frametime_buf + used, *rest;
+        double ms = strtod(number, &rest);
+        // Headers of a log and other lines without a number are skipped
+        if (rest != number) frame_time(ms > 0 ? (uint64_t)(ms * 1e6) : 0);
+        used = end + 1 - context.frametime_buf;
+    }
+    if (used == 0 && len == sizeof(context.frametime_buf) - 1) used = len; // A line that doesn't fit, drop it
+    memmove(context.frametime_buf, context.frametime_buf + used, len - used);
+    context.frametime_len = len - used;
+}
+
+// One measured frame. The window covers the average frame plus twice its deviation, so a game polls
+// at least once during it even when frames vary, and follows the frame rate within a few frames.
+void frame_time(uint64_t ns) {
+    if (ns < FRAME_MIN_NS || ns > FRAME_MAX_NS) return;
+    if (!context.frame_avg_ns) {
+        context.frame_avg_ns = ns;
     } else {
-        emit(EV_KEY, context.vr_keystates[UP].which, up_pressed);
-        emit(EV_KEY, context.vr_keystates[DOWN].which, down_pressed);
+        int64_t error = (int64_t)ns - (int64_t)context.frame_avg_ns;
+        uint64_t deviation = (uint64_t)(error < 0 ? -error : error);
+        context.frame_avg_ns += error / (1 << FRAME_AVG_SHIFT);
+        context.frame_dev_ns += ((int64_t)deviation - (int64_t)context.frame_dev_ns) / (1 << FRAME_DEV_SHIFT);
     }
+    update_neutral();
+}
+
+// Neutral window of one frame, of the fixed frame time or the measured one. In tick mode it is rounded
+// up to whole ticks, since neutral windows end on a tick. Returns the new window, 0 when there is nothing
+// to go by yet.
+uint64_t update_neutral() {
+    uint64_t ns = context.fixed_frame_ns ? context.fixed_frame_ns : context.frame_avg_ns + 2 * context.frame_dev_ns;
+    if (!ns) return 0;
+    if (context.tick_hz) ns = (ns + context.tick_ns - 1) / context.tick_ns * context.tick_ns;
+    // The engine may run on the emitter, its counter is the copy of the window that can be read here
+    if (ns == atomic_load_explicit(&engine.stats->neutral_ns, memory_order_relaxed)) return ns;
+    if (context.split) pipe_push(&context.pipe, (struct transition){ .time = ns, .kind = TR_NEUTRAL });
+    else set_neutral(ns);
+    return ns;
+}
 
-    // Handle SOCD for LEFT and RIGHT keys
-    if (left_pressed && right_pressed) {
-        emit(EV_KEY, context.vr_keystates[LEFT].which, 0);
-        emit(EV_KEY, context.vr_keystates[RIGHT].which, 0);
+// Control socket, only root can connect. It is served on the ring like every other fd, one client at a
+// time: commands run between two batches and their answer is sent while the loop goes on.
+void setup_control() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(context.control_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", context.control_path);
+        exit(1);
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", context.control_path);
+    unlink(addr.sun_path); // Left behind by a socd that didn't exit cleanly
+
+    context.control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    result_msg(context.control_fd, "Failed to create the control socket");
+    mode_t mask = umask(0077);
+    result_msg(bind(context.control_fd, (struct sockaddr *)&addr, sizeof(addr)), context.control_path);
+    umask(mask);
+    result_msg(listen(context.control_fd, 4), "Failed to listen on the control socket");
+}
+
+// Accept a client, then alternate between receiving commands and sending the answer
+void arm_control() {
+    if (context.control_fd < 0 || context.control_armed) return;
+    if (context.client_fd < 0 && !retry_due(&context.control_retry)) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    if (context.client_fd < 0) {
+        io_uring_prep_accept(sqe, context.control_fd, NULL, NULL, SOCK_CLOEXEC);
+        io_uring_sqe_set_data64(sqe, TAG(OP_ACCEPT, 0, 0));
+    } else if (context.reply_sent < context.reply_len) {
+        io_uring_prep_send(sqe, context.client_fd, context.reply + context.reply_sent,
+                           context.reply_len - context.reply_sent, MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, TAG(OP_REPLY, 0, 0));
+    } else {
+        io_uring_prep_recv(sqe, context.client_fd, context.command_buf + context.command_len,
+                           sizeof(context.command_buf) - 1 - context.command_len, 0);
+        io_uring_sqe_set_data64(sqe, TAG(OP_COMMAND, 0, 0));
+    }
+    context.control_armed = 1;
+}
+
+static void drop_client(void) {
+    close(context.client_fd);
+    context.client_fd = -1;
+    context.command_len = context.reply_len = context.reply_sent = 0;
+}
 
-        int last_pressed_index = atomic_load(&context.last_pressed);
-        // Control logic for 'A' and 'D'
-        if (!(up_pressed || down_pressed)) {
-            // Sleep for ~16.67 ms
-            struct timespec sleep_time = {0, 16700000}; // 16.7 ms
-            nanosleep(&sleep_time, NULL);
+// Append to the answer, cut off when it doesn't fit
+static void reply(const char *fmt, ...) {
+    size_t left = sizeof(context.reply) - context.reply_len;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(context.reply + context.reply_len, left, fmt, args);
+    va_end(args);
+    if (n > 0) context.reply_len += (size_t)n < left ? (size_t)n : left - 1;
+}
+
+void handle_control(const struct io_uring_cqe *cqe) {
+    context.control_armed = 0;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) return;
+    switch (TAG_OP(io_uring_cqe_get_data64(cqe))) {
+    case OP_ACCEPT:
+        if (cqe->res < 0) {
+            // Out of file descriptors (EMFILE, ENFILE) doesn't clear up right away, don't spin on it
+            log_limited(&context.control_retry, "Failed to accept a control connection: %s\n", strerror(-cqe->res));
+            backoff(&context.control_retry);
+            return;
+        }
+        context.control_retry.failures = 0;
+        context.client_fd = cqe->res;
+        break;
+    case OP_COMMAND: {
+        if (cqe->res <= 0) {
+            drop_client();
+            return;
+        }
+        size_t len = context.command_len + (size_t)cqe->res, used = 0;
+        char *end;
+        // One command per line, the answers of a batch of commands are sent together
+        while ((end = memchr(context.command_buf + used, '\n', len - used))) {
+            *end = '\0';
+            run_command(context.command_buf + used);
+            used = end + 1 - context.command_buf;
+        }
+        if (used == 0 && len == sizeof(context.command_buf) - 1) {
+            reply("error: command too long\n");
+            used = len;
         }
-        emit(EV_KEY, context.vr_keystates[last_pressed_index].which, 1);  // Emit last pressed key
+        memmove(context.command_buf, context.command_buf + used, len - used);
+        context.command_len = len - used;
+        break;
+    }
+    case OP_REPLY:
+        if (cqe->res < 0) {
+            drop_client();
+            return;
+        }
+        context.reply_sent += (size_t)cqe->res;
+        if (context.reply_sent == context.reply_len) context.reply_len = context.reply_sent = 0;
+        break;
+    }
+}
+
+static unsigned long long counter(const atomic_uint_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+void run_command(char *line) {
+    char *command = strtok(line, " \t\r"), *arg = strtok(NULL, " \t\r");
+    if (!command) return;
+    if (!strcmp(command, "reload")) {
+        reload_config(arg ? arg : context.config_path ? context.config_path : DEFAULT_CONFIG);
+    } else if (!strcmp(command, "enable") || !strcmp(command, "disable")) {
+        context.disabled = command[0] == 'd';
+        update_bypass();
+        reply("ok\n");
+    } else if (!strcmp(command, "stats")) {
+        // The counters are written by whichever thread runs the engine, reading them never waits for it
+        const struct stats *stats = engine.stats;
+        reply("events_in %llu\nevents_out %llu\nframes_out %llu\nconflicts %llu\nneutral_windows %llu\nreloads %llu\n",
+              counter(&stats->events_in), counter(&stats->events_out), counter(&stats->frames_out),
+              counter(&stats->conflicts), counter(&stats->neutral_windows), counter(&stats->reloads));
+        reply("read_errors %llu\nshort_reads %llu\nwrite_errors %llu\nsubmit_errors %llu\n",
+              counter(&stats->read_errors), counter(&stats->short_reads), counter(&stats->write_errors),
+              counter(&stats->submit_errors));
+        for (int histogram = 0; histogram < 2; ++histogram) {
+            reply(histogram ? "cqe_batch" : "read_batch");
+            for (int b = 0; b < BATCH_BUCKETS; ++b) {
+                reply(" %llu", counter(histogram ? &stats->cqe_batch[b] : &stats->read_batch[b]));
+            }
+            reply("\n");
+        }
+        reply("axes %d\ndevices %d\ncleaning %s\n", context.config->axis_count, context.device_count,
+              context.disabled ? "disabled" : context.focused && !app_allowed(context.config, context.focus_app) ? "unfocused" : "on");
+    } else if (!strcmp(command, "latency")) {
+        if (!context.latency) {
+            reply("error: latencies are only recorded with --latency\n");
+            return;
+        }
+        char hist[256];
+        if (context.split) {
+            hist_format(&context.queue_hist, "input to emitter latency", hist, sizeof(hist));
+            reply("%s", hist);
+        }
+        hist_format(&context.lat_hist, "input to uinput latency", hist, sizeof(hist));
+        reply("%s", hist);
+    } else if (!strcmp(command, "fps")) {
+        if (arg) {
+            double fps = strtod(arg, NULL);
+            if (strcmp(arg, "auto") && fps <= 0) {
+                reply("error: expected a frame rate or auto\n");
+                return;
+            }
+            // auto goes back to the frame time feed, or keeps the last window when there is none
+            context.fixed_frame_ns = fps > 0 ? (uint64_t)(1e9 / fps) : 0;
+        }
+        uint64_t neutral = update_neutral();
+        if (!neutral) neutral = atomic_load_explicit(&engine.stats->neutral_ns, memory_order_relaxed);
+        reply("neutral %.2f ms, %s\n", neutral / 1e6,
+              context.fixed_frame_ns ? "fixed" : context.frame_avg_ns ? "measured" : "configured");
+    } else if (!strcmp(command, "help")) {
+        reply("reload [FILE]  load the config file again, or FILE\n"
+              "enable         clean keys\n"
+              "disable        let keys through as they are\n"
+              "stats          event counters\n"
+              "latency        latency percentiles (--latency)\n"
+              "fps [N | auto] neutral window of one frame at N FPS, or measured (--frametime)\n");
     } else {
-        emit(EV_KEY, context.vr_keystates[LEFT].which, left_pressed);
-        emit(EV_KEY, context.vr_keystates[RIGHT].which, right_pressed);
+        reply("error: unknown command '%s', try help\n", command);
     }
+}
 
-    emit(EV_SYN, SYN_REPORT, 0);
+// Parse into the spare config while the active one stays in use, then switch between two frames.
+// A config that doesn't load leaves everything as it was.
+void reload_config(const char *path) {
+    if (atomic_load_explicit(&context.config_pending, memory_order_acquire)) {
+        reply("error: busy, the last reload isn't applied yet\n");
+        return;
+    }
+    struct config *config = &engine.configs[context.config == &engine.configs[0]];
+    char error[PATH_MAX + 128];
+    if (parse_config(path, config, error, sizeof(error)) < 0) {
+        reply("error: %s\n", error);
+        return;
+    }
+    for (int a = 0; a < config->axis_count; a++) {
+        for (int side = 0; side < 2; side++) {
+            int code = config->axes[a].keys[side];
+            if (!(context.key_bits[code / 8] & (1 << (code % 8)))) {
+                reply("error: the virtual device can't send key %d, restart socd for this config\n", code);
+                return;
+            }
+        }
+    }
+    for (int i = 0; i < config->abs_count && context.gamepad_fd >= 0; ++i) {
+        if (!(context.abs_bits >> config->abs[i].code & 1)) {
+            reply("error: the virtual gamepad has no axis %d, restart socd for this config\n", config->abs[i].code);
+            return;
+        }
+    }
+    add_cli_apps(config);
+
+    context.config = config;
+    if (context.split) {
+        // The emitter owns the engine, it switches once it gets here in the queue
+        atomic_store_explicit(&context.config_pending, 1, memory_order_relaxed);
+        pipe_push(&context.pipe, (struct transition){ .kind = TR_CONFIG });
+    } else {
+        use_config(config);
+    }
+    if (config->app_count && context.focus_fd < 0) setup_focus();
+    update_bypass();
+    reply("ok, %d axes\n", config->axis_count);
+}
+
+// Put the counters into a file that other processes can map and read at any rate, nothing on the hot
+// path changes. Readers check magic, version and size, and pid to tell a stale file from a running socd.
+void setup_stats() {
+    int fd = open(context.stats_path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    result_msg(fd, context.stats_path);
+    result_msg(ftruncate(fd, sizeof(struct stats)), context.stats_path);
+    struct stats *stats = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (stats == MAP_FAILED) {
+        perror(context.stats_path);
+        exit(1);
+    }
+    close(fd);
+
+    stats->version = STATS_VERSION;
+    stats->size = sizeof(struct stats);
+    stats->pid = (uint32_t)getpid();
+    atomic_thread_fence(memory_order_release);
+    stats->magic = STATS_MAGIC;
+    engine.stats = stats;
+}
+
+void close_stats() {
+    if (!context.stats_path) return;
+    unlink(context.stats_path);
+}
+
+void close_control() {
+    if (context.client_fd >= 0) close(context.client_fd);
+    if (context.control_fd < 0) return;
+    close(context.control_fd);
+    unlink(context.control_path);
+}
+
+// Tick sink: nothing to arm, every tick runs emit_all() and the deadline is a whole number of ticks away
+void tick_timer(uint64_t deadline) {
+    (void)deadline;
+}
+
+// Tick sink: time of the current tick
+uint64_t tick_now() {
+    return engine.frame_counter * context.tick_ns;
+}
+
+void setup_tick() {
+    context.tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    result_msg(context.tick_fd, "Failed to create the tick timer");
+    struct itimerspec spec = {
+        .it_interval = { context.tick_ns / 1000000000, context.tick_ns % 1000000000 },
+        .it_value = { context.tick_ns / 1000000000, context.tick_ns % 1000000000 },
+    };
+    result_msg(timerfd_settime(context.tick_fd, 0, &spec, NULL), "Failed to start the tick timer");
+}
+
+void arm_tick() {
+    if (context.tick_fd < 0 || context.tick_armed) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_read(sqe, context.tick_fd, &context.tick_expirations, sizeof(context.tick_expirations), 0);
+    io_uring_sqe_set_data64(sqe, TAG(OP_TICK, 0, 0));
+    context.tick_armed = 1;
+}
+
+// Ticks missed while the loop was busy still count, so neutral windows keep their length in time
+void handle_tick(const struct io_uring_cqe *cqe) {
+    context.tick_armed = 0;
+    if (cqe->res != sizeof(context.tick_expirations)) return;
+    if (context.split) context.pending_ticks += context.tick_expirations;
+    else engine.frame_counter += context.tick_expirations;
+    context.ticked = 1;
+}
+
+void handle_write(const struct io_uring_cqe *cqe) {
+    int i = (int)TAG_IDX(io_uring_cqe_get_data64(cqe));
+    context.idle_writes |= 1u << i;
+    if (context.lat_writing_count && i == context.lat_write) {
+        record_samples(context.lat_writing, context.lat_writing_count);
+        context.lat_writing_count = 0;
+    }
+    if (cqe->res >= 0) return;
+    if (classify_error(-cqe->res) != ERR_RETRY) {
+        fprintf(stderr, "Failed to write to the virtual device: %s\n", strerror(-cqe->res));
+        exit(1);
+    }
+    STAT_ADD(engine.stats->write_errors, 1);
+    // Exported counters replace the log for the errors socd recovers from on its own
+    if (!context.stats_path) log_limited(&context.write_retry, "Write to the virtual device failed: %s, frame dropped\n", strerror(-cqe->res));
+}
+
+// Submit the queued frames and wait until every write completed. Other completions are dropped, this only
+// runs on the way out.
+void drain_writes() {
+    if (!context.ring_writes) return;
+    uint32_t all = (uint32_t)((1ull << WRITE_BUFS) - 1);
+    if (context.idle_writes != all && io_uring_submit(&ring) < 0) STAT_ADD(engine.stats->submit_errors, 1);
+    while (context.idle_writes != all) {
+        struct io_uring_cqe *cqe;
+        struct __kernel_timespec wait = { .tv_sec = 1 };
+        if (io_uring_wait_cqe_timeout(&ring, &cqe, &wait) < 0) break; // Never submitted, nothing to wait for
+        if (TAG_OP(io_uring_cqe_get_data64(cqe)) == OP_WRITE) handle_write(cqe);
+        io_uring_cqe_seen(&ring, cqe);
+    }
 }
 
+// Next free SQE, flushing the submission queue to the kernel when it is full
+struct io_uring_sqe *get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (!sqe && io_uring_submit(&ring) >= 0) sqe = io_uring_get_sqe(&ring);
+    return sqe;
+}
+
+// Engine sink: wake the loop at deadline with an absolute io_uring timeout, its completion runs emit_all()
+void ring_timer(uint64_t deadline) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return; // Can't submit, the next event ends the neutral window instead
+    struct __kernel_timespec *ts = &context.timer_ts[context.timer_next++ % TIMER_SLOTS];
+    *ts = (struct __kernel_timespec){ .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+    io_uring_prep_timeout(sqe, ts, 0, IORING_TIMEOUT_ABS);
+    io_uring_sqe_set_data64(sqe, TAG(OP_TIMEOUT, 0, 0));
+}
+
+int classify_error(int err) {
+    switch (err) {
+    case EAGAIN: case EINTR: case EBUSY: case ENOBUFS: case ENOMEM: case ECANCELED: case ETIME:
+        return ERR_RETRY;
+    case ENODEV: case ENXIO: case ENOENT: case EIO: case ESHUTDOWN:
+        return ERR_DEVICE;
+    default:
+        return ERR_FATAL;
+    }
+}
+
+// Push the next attempt out, BACKOFF_MIN_NS doubling up to ~1 s, and wake the loop when it is due
+void backoff(struct retry *r) {
+    unsigned int shift = r->failures < BACKOFF_MAX_SHIFT ? r->failures : BACKOFF_MAX_SHIFT;
+    r->failures++;
+    r->at = now_ns() + (BACKOFF_MIN_NS << shift);
+    ring_timer(r->at);
+}
+
+// Whether the backoff ran out, only reads the clock while backing off
+int retry_due(struct retry *r) {
+    if (!r->at) return 1;
+    if (now_ns() < r->at) return 0;
+    r->at = 0;
+    return 1;
+}
+
+// At most one message per second and source, counting the ones that were dropped
+void log_limited(struct retry *r, const char *fmt, ...) {
+    uint64_t now = now_ns();
+    if (now < r->log_next) {
+        r->suppressed++;
+        return;
+    }
+    r->log_next = now + 1000000000;
+    if (r->suppressed) fprintf(stderr, "(%u similar messages suppressed)\n", r->suppressed);
+    r->suppressed = 0;
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+// io_uring_enter failed. Running out of kernel resources or a full completion queue (-EAGAIN, -EBUSY)
+// clears up once completions are reaped, so those are reaped first and the loop only sleeps when there
+// are none. Anything else means the ring is unusable.
+void submit_failed(int err) {
+    if (classify_error(err) != ERR_RETRY) {
+        fprintf(stderr, "io_uring submission failed: %s\n", strerror(err));
+        exit(1);
+    }
+    STAT_ADD(engine.stats->submit_errors, 1);
+    if (!context.stats_path) log_limited(&context.submit_retry, "io_uring submission failed: %s, backing off\n", strerror(err));
+    if (io_uring_cq_ready(&ring)) return;
+
+    unsigned int shift = context.submit_retry.failures < BACKOFF_MAX_SHIFT ? context.submit_retry.failures : BACKOFF_MAX_SHIFT;
+    context.submit_retry.failures++;
+    uint64_t wait_ns = BACKOFF_MIN_NS << shift;
+    struct timespec wait = { wait_ns / 1000000000, wait_ns % 1000000000 };
+    nanosleep(&wait, NULL);
+}
+
+// Touch the stack the loop will use so its pages are mapped (and locked) before the first event
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile char stack[STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+// Opt-in scheduling setup for the event loop, everything it touches already exists at this point
+void setup_realtime() {
+    if (context.mlock) {
+        // MCL_CURRENT populates every mapping, including the context, the read buffers and the rings
+        result_msg(mlockall(MCL_CURRENT | MCL_FUTURE), "Failed to lock memory");
+        prefault_stack();
+    }
+    if (context.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(context.cpu, &set);
+        result_msg(sched_setaffinity(0, sizeof(set), &set), "Failed to pin the event loop");
+    }
+    if (context.rt_prio > 0) {
+        struct sched_param param = { .sched_priority = context.rt_prio };
+        result_msg(sched_setscheduler(0, SCHED_FIFO, &param), "Failed to set SCHED_FIFO");
+    }
+}
+
+void add_device(const char *path) {
+    if (context.device_count == MAX_DEVICES) {
+        fprintf(stderr, "Too many devices, at most %d are supported\n", MAX_DEVICES);
+        exit(1);
+    }
+    struct device *dev = &context.devices[context.device_count++];
+    snprintf(dev->path, sizeof(dev->path), "%s", path);
+    dev->fd = -1;
+    dev->wd = -1;
+    dev->parent_wd = -1;
+}
+
+int open_device(struct device *dev) {
+    dev->fd = open(dev->path, O_RDONLY | O_NONBLOCK);
+    if (dev->fd < 0) return -1;
+
+    // Timestamps order presses across devices and are compared against now_ns(), a wall clock stepped back
+    // (NTP at boot) would stop last input priority until it caught up again
+    int clock_id = CLOCK_MONOTONIC;
+    result_msg(ioctl(dev->fd, EVIOCSCLOCKID, &clock_id), "Failed to set the event clock");
+
+    // Analog sources are centered on the range of the device
+    uint64_t abs_bits = 0;
+    if (ioctl(dev->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), &abs_bits) < 0) abs_bits = 0;
+    for (int code = 0; code < ABS_CNT; ++code) {
+        struct input_absinfo info;
+        if (!(abs_bits >> code & 1) || ioctl(dev->fd, EVIOCGABS(code), &info) < 0) continue;
+        set_abs_range((int)(dev - context.devices), code, info.minimum, info.maximum);
+    }
+    return 0;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Directory of a device without its trailing slash, "." when the path has none
+static void device_dir(const struct device *dev, char *dir, size_t size) {
+    int len = (int)(base_name(dev->path) - dev->path);
+    while (len > 1 && dev->path[len - 1] == '/') len--;
+    snprintf(dir, size, "%.*s", len, len ? dev->path : ".");
+}
+
+// Watch the directory of a device, and the one above it for the directory to come back. Directories
+// are shared between devices and roles, so watches only ever add to their mask.
+static void watch_device(struct device *dev) {
+    char dir[sizeof(dev->path)];
+    device_dir(dev, dir, sizeof(dir));
+    dev->wd = inotify_add_watch(context.inotify_fd, dir, HOTPLUG_EVENTS | IN_MASK_ADD);
+    if (dev->wd < 0 && errno != ENOENT) perror(dir);
+    if (dev->parent_wd >= 0 || !strchr(dir, '/') || base_name(dir) == dir + 1) return; // Relative or at the root
+    char parent[sizeof(dir)];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(base_name(dir) - dir), dir);
+    dev->parent_wd = inotify_add_watch(context.inotify_fd, parent, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+}
+
+// Watch the directories the devices live in, udev adds and removes their symlinks on hotplug
+void setup_hotplug() {
+    context.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (context.inotify_fd < 0) {
+        perror("Hotplug disabled, inotify failed");
+        return;
+    }
+    for (int d = 0; d < context.device_count; ++d) watch_device(&context.devices[d]);
+}
+
+// A watched directory went away (IN_IGNORED), or the directory of a device came back
+static void hotplug_dir(const struct inotify_event *ev) {
+    for (int d = 0; d < context.device_count; ++d) {
+        struct device *dev = &context.devices[d];
+        if (ev->mask & IN_IGNORED) {
+            if (dev->parent_wd == ev->wd) dev->parent_wd = -1;
+            if (dev->wd != ev->wd) continue;
+            // Its links went with it
+            dev->wd = -1;
+            device_lost(d);
+            continue;
+        }
+        char dir[sizeof(dev->path)];
+        device_dir(dev, dir, sizeof(dir));
+        if (!(ev->mask & (IN_CREATE | IN_MOVED_TO)) || dev->wd >= 0 || dev->parent_wd != ev->wd || strcmp(base_name(dir), ev->name)) continue;
+        watch_device(dev);
+        // The link may have been created before the watch was
+        if (access(dev->path, F_OK) == 0) {
+            dev->retry = (struct retry){ 0 };
+            device_found(d);
+        }
+    }
+}
+
+void arm_hotplug() {
+    if (context.inotify_fd < 0 || context.inotify_armed || !retry_due(&context.hotplug_retry)) return;
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) return;
+    io_uring_prep_read(sqe, context.inotify_fd, context.inotify_buf, sizeof(context.inotify_buf), 0);
+    io_uring_sqe_set_data64(sqe, TAG(OP_HOTPLUG, 0, 0));
+    context.inotify_armed = 1;
+}
+
+void handle_hotplug(const struct io_uring_cqe *cqe) {
+    context.inotify_armed = 0;
+    if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        log_limited(&context.hotplug_retry, "Hotplug read failed: %s\n", strerror(-cqe->res));
+        backoff(&context.hotplug_retry);
+        return;
+    }
+    if (cqe->res <= 0) return;
+    context.hotplug_retry.failures = 0;
+
+    for (char *p = context.inotify_buf; p < context.inotify_buf + cqe->res;) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        p += sizeof(*ev) + ev->len;
+        if ((ev->mask & IN_IGNORED) || (ev->len && (ev->mask & IN_ISDIR))) {
+            hotplug_dir(ev);
+            continue;
+        }
+        if (!ev->len) continue;
+
+        int known = 0;
+        for (int d = 0; d < context.device_count; ++d) {
+            struct device *dev = &context.devices[d];
+            if (dev->wd != ev->wd || strcmp(base_name(dev->path), ev->name)) continue;
+            known = 1;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                device_lost(d);
+            } else {
+                // A new device node, whatever failed on the old one doesn't count against it
+                dev->retry = (struct retry){ 0 };
+                device_found(d);
+            }
+        }
+
+        // With --all a keyboard plugged into a watched directory is picked up as well. Keys the
+        // virtual device was not created with can't be forwarded by the grab passthrough.
+        int len = strlen(ev->name);
+        if (!known && context.all_devices && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+            context.device_count < MAX_DEVICES && len >= 15 &&
+            !strcmp(ev->name + len - 10, "-event-kbd") && strncmp(ev->name + len - 15, "-if", 3)) {
+            for (int d = 0; d < context.device_count; ++d) {
+                if (context.devices[d].wd != ev->wd) continue;
+                char path[sizeof(context.devices[d].path)];
+                snprintf(path, sizeof(path), "%.*s%s", (int)(base_name(context.devices[d].path) - context.devices[d].path),
+                         context.devices[d].path, ev->name);
+                add_device(path);
+                context.devices[context.device_count - 1].wd = ev->wd;
+                context.devices[context.device_count - 1].parent_wd = context.devices[d].parent_wd;
+                device_found(context.device_count - 1);
+                break;
+            }
+        }
+    }
+}
+
+// Stop reading a device that went away and release everything it held
+void device_lost(int d) {
+    struct device *dev = &context.devices[d];
+    if (dev->fd < 0 || dev->lost) return;
+
+    fprintf(stderr, "Lost %s\n", dev->path);
+    dev->lost = 1;
+    if (context.split) pipe_push(&context.pipe, (struct transition){ .dev = d, .kind = TR_RELEASE });
+    else release_device(d);
+
+    // Pending reads normally fail with ENODEV by themselves, the cancel covers the ones that don't
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe) {
+        io_uring_prep_cancel_fd(sqe, dev->fd, IORING_ASYNC_CANCEL_ALL);
+        io_uring_sqe_set_data64(sqe, TAG(OP_CANCEL, d, 0));
+    }
+}
+
+// A read failed: transient errors are re-armed right away, a device that vanished or broke goes through
+// hotplug recovery, and everything else is retried with exponential backoff instead of spinning
+void device_error(int d, int err) {
+    struct device *dev = &context.devices[d];
+    if (err == EINTR || err == ECANCELED) return; // Cancelled by device_lost(), or interrupted
+
+    int kind = classify_error(err);
+    STAT_ADD(engine.stats->read_errors, 1);
+    if (kind == ERR_RETRY) return; // The buffer is idle again, arm_reads() re-arms it on this pass
+    if (kind == ERR_DEVICE && dev->lost) return; // The other reads in flight when it went away
+    if (kind != ERR_DEVICE && !context.stats_path) log_limited(&dev->retry, "Read error on %s: %s\n", dev->path, strerror(err));
+    backoff(&dev->retry);
+    if (kind == ERR_DEVICE) {
+        device_lost(d);
+        // The node is still there (-EIO), there won't be a hotplug event, so reopen it after the backoff
+        if (access(dev->path, F_OK) == 0) dev->reopen = 1;
+    }
+}
+
+void device_found(int d) {
+    struct device *dev = &context.devices[d];
+    if (dev->lost) {
+        // Still draining the reads of the old fd, check_device() reopens it. The backoff was for the old
+        // node, a new one is opened right away.
+        dev->reopen = 1;
+        dev->retry.at = 0;
+        dev->retry.failures = 0;
+        return;
+    }
+    if (dev->fd >= 0) return;
+    if (dev->retry.at) {
+        // Backing off, arm_reads() opens it once the time is up
+        dev->reopen = 1;
+        return;
+    }
+
+    if (open_device(dev) < 0) {
+        int err = errno;
+        if (err == ENOENT) return; // Gone again, hotplug tells us when it is back
+        log_limited(&dev->retry, "%s: %s\n", dev->path, strerror(err));
+        dev->reopen = 1;
+        backoff(&dev->retry);
+        return;
+    }
+    if (context.grab) result_msg(ioctl(dev->fd, EVIOCGRAB, 1), "Failed to grab keyboard");
+    update_file(d, dev->fd);
+    fprintf(stderr, "Opened %s\n", dev->path);
+}
+
+// Close a lost device once none of its reads is in flight anymore, so the buffers can be reused
+void check_device(int d) {
+    struct device *dev = &context.devices[d];
+    if (!dev->lost || dev->multishot_armed || dev->idle_reads != ALL_READS) return;
+
+    update_file(d, -1);
+    close(dev->fd);
+    dev->fd = -1;
+    dev->lost = 0;
+    if (dev->reopen) {
+        dev->reopen = 0;
+        device_found(d);
+    }
+}
+
+// Add the keyboards found in a /dev/input directory, asking which ones when there are several
 int get_keyboard(const char *path) {
     DIR *d = opendir(path);
     if (!d) return 1;
 
-    strcpy(context.rd_target, path);
-    char *possible_devices[8];
-    int j = 0, selected = 0;
+    char **possible_devices = NULL;
+    int j = 0;
     struct dirent *dir;
 
-    while ((dir = readdir(d)) != NULL && j < 8) {
+    while ((dir = readdir(d)) != NULL) {
         int len = strlen(dir->d_name);
-        if (len >= 10 && strncmp(dir->d_name + len - 10, "-event-kbd", 10) == 0 &&
+        if (len >= 15 && strncmp(dir->d_name + len - 10, "-event-kbd", 10) == 0 &&
             strncmp(dir->d_name + len - 15, "-if", 3) != 0) {
-            possible_devices[j++] = dir->d_name;
+            possible_devices = realloc(possible_devices, (j + 1) * sizeof(*possible_devices));
+            if (!possible_devices) exit(1);
+            possible_devices[j++] = strdup(dir->d_name);
         }
     }
+    closedir(d);
 
-    if (j == 0) {
-        closedir(d);
-        return 1;
-    }
+    if (j == 0) return 1;
 
-    if (j > 1) {
-        selected = prompt_user(j);
-    } else {
-        selected = 0; // Only one device available
+    int selected = 0; // Only one device available
+    if (context.all_devices) selected = -1;
+    else if (j > 1) selected = prompt_user(possible_devices, j);
+
+    char device_path[275];
+    for (int i = 0; i < j; ++i) {
+        if (selected < 0 || selected == i) {
+            snprintf(device_path, sizeof(device_path), "%s%s", path, possible_devices[i]);
+            add_device(device_path);
+        }
+        free(possible_devices[i]);
     }
+    free(possible_devices);
+    return 0;
+}
+
+// Add every event device in a /dev/input directory that matches --id and --phys.
+// by-id and by-path both link the same nodes, those are only added once.
+int match_devices(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) return 1;
+
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        if (!strstr(dir->d_name, "-event-")) continue;
+
+        char device_path[275], real[PATH_MAX];
+        snprintf(device_path, sizeof(device_path), "%s%s", path, dir->d_name);
+        if (!realpath(device_path, real)) continue;
+        int seen = 0;
+        for (int i = 0; i < context.device_count; ++i) {
+            char other[PATH_MAX];
+            if (realpath(context.devices[i].path, other) && !strcmp(real, other)) seen = 1;
+        }
+        if (seen) continue;
 
-    strcat(context.rd_target, possible_devices[selected]);
+        int fd = open(device_path, O_RDONLY | O_NONBLOCK);
+        if (fd < 0) continue;
+        struct input_id id;
+        char phys[256] = { 0 };
+        int match = 1;
+        if (context.match_vendor >= 0) {
+            match = ioctl(fd, EVIOCGID, &id) >= 0 && id.vendor == context.match_vendor && id.product == context.match_product;
+        }
+        if (match && context.match_phys) {
+            match = ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys) >= 0 && !fnmatch(context.match_phys, phys, 0);
+        }
+        close(fd);
+        if (match) add_device(device_path);
+    }
     closedir(d);
     return 0;
 }
 
-int prompt_user(int max) {
-    char c;
+// Use the devices picked last time, returns 1 when the cache is missing or out of date
+int load_device_cache() {
+    FILE *f = fopen(DEVICE_CACHE, "r");
+    if (!f) return 1;
+
+    char line[275];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!line[0]) continue;
+        if (access(line, R_OK) != 0) {
+            // A cached device is gone, forget the whole choice
+            context.device_count = 0;
+            break;
+        }
+        add_device(line);
+    }
+    fclose(f);
+    return context.device_count == 0;
+}
+
+void save_device_cache() {
+    mkdir(DEVICE_CACHE_DIR, 0755);
+    FILE *f = fopen(DEVICE_CACHE, "w");
+    if (!f) return; // Only costs the scan next time
+    for (int d = 0; d < context.device_count; ++d) fprintf(f, "%s\n", context.devices[d].path);
+    fclose(f);
+}
+
+// Index of the chosen device, -1 for all of them
+int prompt_user(char **names, int max) {
+    char line[32];
+    for (int i = 0; i < max; ++i) printf("%d: %s\n", i + 1, names[i]);
     while (1) {
-        printf("Select keyboard device (1-%d): ", max);
+        printf("Select keyboard device (1-%d, a for all): ", max);
         fflush(stdout);
-        ssize_t read_ret = read(STDIN_FILENO, &c, 1);
-        if (read_ret < 0) {
-            perror("Error reading from stdin");
-            continue;
+        if (!fgets(line, sizeof(line), stdin)) {
+            fprintf(stderr, "Error reading from stdin\n");
+            exit(1);
         }
-        if (c < '1' || c >= '1' + max) continue;
-        break;
+        if (line[0] == 'a') return -1;
+        int n = atoi(line);
+        if (n < 1 || n > max) continue;
+        return n - 1;
     }
-    return c - '1';
 }
@@ -0,0 +1,27 @@
+#ifndef SOCD_TRACE_H
+#define SOCD_TRACE_H
+
+#include <stdint.h>
+
+// Compact binary event trace: a trace_header followed by trace_records
+
+#define TRACE_MAGIC   "SOCDTRC1"
+#define TRACE_VERSION 1
+#define TRACE_OUTPUT  0x80 // tag bit of an event written by socd, events read from a device have it clear
+#define TRACE_DEV(tag) ((tag) & 0x7f)
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct trace_record {
+    uint64_t time; // Nanoseconds, CLOCK_MONOTONIC
+    int32_t value;
+    uint16_t code;
+    uint8_t type;
+    uint8_t tag; // Source device, or TRACE_OUTPUT
+};
+
+#endif